@@ -1,14 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
 
 #include "braid.hpp"
+#include "checkpoint.hpp"
+#include "coarseprop.hpp"
+#include "compress.hpp"
 #include "defs.hpp"
 // #include "_braid.h"
 #include "dataset.hpp"
+#include "ftasks.hpp"
+#include "gradexchange.hpp"
 #include "layer.hpp"
 #include "network.hpp"
+#include "shmtransport.hpp"
+#include "spatialcoarsen.hpp"
 #pragma once
 
+/* Version of the braid message layout (see BraidMsgHeader) */
+#define BRAID_MSG_VERSION 5
+
+/* Alignment (in bytes) of the payload sections of a braid message */
+#define BRAID_MSG_ALIGN 64
+
+/**
+ * Header of a braid message. It is followed by an aligned payload section
+ * holding the network state (nbatch * nchannels MyReals, example by example).
+ * Primal messages carry a reference to their layer (index and design
+ * version) instead of its weights. The receiver takes the layer from the
+ * network's cache of remote layers (see Network::getRemoteLayer).
+ * The state section may be compressed (see compress.hpp). Between ranks on
+ * the same node, the state can be passed in a shared memory slot instead
+ * (see ShmTransport), the state section is then empty.
+ */
+struct BraidMsgHeader {
+  int version;   /* Layout version, must match BRAID_MSG_VERSION */
+  int nbatch;    /* Number of examples in the state section */
+  int nchannels; /* Number of channels in the state section */
+  int haslayer;  /* Flag: 1 if the message refers to a layer, 0 else */
+  int compress;  /* Compression type of the state section */
+  int nbytes;    /* Number of bytes in the state section */
+  int shmowner;  /* Rank owning the shared memory slot of the state */
+  int shmslot;   /* Shared memory slot of the state, -1 if not used */
+  int level;     /* Braid level of the state */
+
+  /* Layer reference, only valid if haslayer */
+  int index;         /* Layer index */
+  int designversion; /* Design version of the sender */
+  int layertype;     /* Type of the layer (for consistency checks) */
+  int ndesign;       /* Number of design variables (for consistency checks) */
+};
+
 /**
  * Define the state vector at one time-step
  */
@@ -17,13 +61,17 @@ class myBraidVector {
   int nbatch;    /* Number of examples */
   int nchannels; /* Number of channels */
 
-  MyReal *
-      *state;   /* Network state at one layer, dimensions: nbatch * nchannels */
-  Layer *layer; /* Pointer to layer information */
+  MyReal *data;   /* Contiguous storage of the state (nbatch * nchannels) */
+  MyReal **state; /* Network state at one layer, state[iex] points into data */
+  Layer *layer;   /* Pointer to layer information */
+  int level;      /* Braid level of the state (0: fine grid) */
+
+  ShmTransport *shm; /* Transport owning data, NULL if data is allocated */
+  int shmowner;      /* Owner of the shared memory slot */
+  int shmslot;       /* Shared memory slot holding data */
 
-  /* Flag that determines if the layer and state have just been received and
-   * thus should be free'd after usage (flag > 0) */
-  MyReal sendflag;
+  /* Set up the state pointers into data */
+  void setStatePointers();
 
  public:
   /* Get dimensions */
@@ -36,16 +84,24 @@ class myBraidVector {
   /* Get pointer to the full state matrix */
   MyReal **getState();
 
+  /* Get pointer to the contiguous state storage */
+  MyReal *getData();
+
   /* Get and set pointer to the layer */
   Layer *getLayer();
   void setLayer(Layer *layer);
 
-  /* Get and set the sendflag */
-  MyReal getSendflag();
-  void setSendflag(MyReal value);
-
-  /* Constructor */
-  myBraidVector(int nChannels, int nBatch);
+  /* Get and set the braid level. Steps set the level they are taken on,
+   * Coarsen and Refine move it by one. */
+  int getLevel();
+  void setLevel(int Level);
+
+  /* Constructor, the state is allocated on the thread pool */
+  myBraidVector(int nChannels, int nBatch, ThreadPool *threads);
+  /* Constructor for a state in a shared memory slot, which is released by the
+   * destructor */
+  myBraidVector(int nChannels, int nBatch, ShmTransport *Shm, int owner,
+                int slot);
   /* Destructor */
   ~myBraidVector();
 };
@@ -63,6 +119,47 @@ class myBraidApp : public BraidApp {
 
   BraidCore *core; /* Braid core for running PinT simulation */
 
+  /* Compression of the message states */
+  int compress_type;      /* Compression type (see compresstype) */
+  MyReal compress_factor; /* Quantization error relative to the residual */
+  MyReal rnorm;           /* Last braid residual norm, -1 if not available */
+
+  /* Intra-node transport of the message states */
+  ShmTransport *shm; /* Shared memory slots */
+  int shmsend;       /* Flag: 1 if all receivers are on this node */
+
+  /* Checkpoints of the fine grid states, filled in Access (NULL if unused) */
+  CheckpointStore *checkpoints;
+
+  /* F-intervals of the fine grid computed as tasks (NULL if unused) */
+  FIntervalTasks *ftasks;
+
+  /* Layers for the steps on the coarse levels */
+  CoarsePropagator *coarseprop;
+
+  /* Image resolutions of the coarse levels, NULL if not coarsened */
+  SpatialCoarsening *spatial;
+
+  /* Initial guess of the runs (see warmstarttype) */
+  int warmstart;
+
+  /* Sweeps over the layers instead of braid */
+  int serial;                 /* Flag: 1 if the runs don't use braid */
+  myBraidVector *serialstate; /* State of the sweeps (NULL before a run) */
+
+  /* Cost of the steps on each level and convergence of the runs */
+  std::vector<int> levelsteps;   /* Number of steps */
+  std::vector<MyReal> leveltime; /* Time spent in the steps */
+  std::vector<MyReal> pointtime; /* Time spent on each primal time point */
+  MyReal convfactors;            /* Sum of the convergence factors */
+  int nconvfactors;              /* Number of runs in convfactors */
+
+  /* Braid iterations of the runs */
+  int maxiter;     /* Current iteration cap */
+  int niter;       /* Iterations of the last run */
+  int niterations; /* Iterations of all runs */
+  int nitercap;    /* Sum of the iteration caps of all runs */
+
   /* Output */
   MyReal objective; /* Objective function */
 
@@ -79,16 +176,118 @@ class myBraidApp : public BraidApp {
   /* Return the core */
   BraidCore *getCore();
 
+  /* Set the tolerance and the iteration cap of the following runs */
+  void setTolerance(MyReal abstol, int maxiter);
+
+  /* Return the number of braid iterations of the last run */
+  int getnIter();
+
+  /* Set a store for checkpoints of the fine grid states */
+  void setCheckpointStore(CheckpointStore *store);
+
   /* Get xbraid's grid distribution */
   void GetGridDistribution(int *ilower_ptr, int *iupper_ptr);
 
   /* Return the time step index of current time t */
   braid_Int GetTimeStepIndex(MyReal t);
 
+  /* At the start of a sweep over the fine grid F-intervals, i.e. a step from
+   * the first C-point with its current value: compute all F-intervals of
+   * this processor as tasks */
+  void LaunchFIntervalTasks(int ts, myBraidVector *u);
+
+  /* Store the current braid residual norm (called from Step) */
+  void SetResidualNorm(BraidStepStatus &pstatus);
+
+  /* Apply the fine grid step from time step ts to u, outside of braid. The
+   * adjoint step updates the gradient, if compute_gradient is set. */
+  virtual void StepLocal(myBraidVector *u, int ts, int compute_gradient);
+
+  /* Solve without braid: each processor steps over its time steps in turn,
+   * starting from the state passed on by the neighbouring processor */
+  virtual void RunSerial();
+
+  /* Return the vector at the final time on the processor holding it, NULL
+   * on the others */
+  myBraidVector *GetLastState();
+
+  /**
+   * Set the initial guess of a run on the fine grid of a core that has been
+   * run before: zero (WARMSTART_NONE), or the states propagated by StepLocal
+   * from the first state stored on this processor (WARMSTART_SWEEP). The
+   * initial condition must have been set.
+   */
+  void SetInitialGuess();
+
+  /* Return the image resolution of u (0: fine) */
+  int GetResolution(myBraidVector *u);
+
+  /* Return the image resolution of the states on a braid level. Coarsen
+   * halves the images once per level, down to the coarsest resolution. */
+  int GetLevelResolution(int level);
+
+  /* Exit with an error if the resolution of u doesn't match its level */
+  void CheckResolution(myBraidVector *u);
+
+  /* Add a step on a level that took time seconds to the level statistics.
+   * Its time is also added to the cost of the primal time point it starts
+   * from (see CountPoint). */
+  void CountStep(int level, int point, MyReal time);
+
+  /* Add time seconds spent on primal time point 0 .. ntime, e.g. by the
+   * opening layer at point 0 or the classification at point ntime. Braid
+   * keeps the steps of all levels starting from a point on the processor
+   * holding it. */
+  void CountPoint(int point, MyReal time);
+
+  /* Return the time spent on each primal time point on this processor */
+  std::vector<MyReal> &getPointTimes();
+
+  /* Return the mean convergence factor (residual reduction per braid
+   * iteration) of the runs, -1 if no residual norms are available */
+  MyReal getConvergenceFactor();
+
+  /**
+   * Collective on comm: Writes the number of steps on each level (summed
+   * over all processors), the time spent in them (max. over all processors),
+   * the braid iterations and the mean convergence factor to outfile on
+   * rank 0.
+   */
+  void writeLevelStats(FILE *outfile, const char *name, MPI_Comm comm);
+
+  /* Return the max. quantization error for each entry of the message state
+   * u. The error in the spatial norm of the state then stays below
+   * compress_factor * rnorm. Zero, if no residual norm is available yet. */
+  MyReal GetCompressTol(myBraidVector *u);
+
+  /* Return the compression type of the message state u. States of the fine
+   * grid are sent exactly, the others are rounded to fp32 or bf16 only if
+   * that keeps the error below GetCompressTol(u). */
+  int GetCompressType(myBraidVector *u);
+
+  /* Return the max. number of bytes of the state section of a message */
+  size_t StateBufSize();
+
+  /* Pack the state of u into a shared memory slot, or compress it into the
+   * state section of a message. Sets the state fields of the header. */
+  void PackState(myBraidVector *u, BraidMsgHeader *header, char *buffer);
+
+  /* Return a new vector holding the state of a message */
+  myBraidVector *UnpackState(BraidMsgHeader *header, char *buffer);
+
   /* Apply one time step */
   virtual braid_Int Step(braid_Vector u_, braid_Vector ustop_,
                          braid_Vector fstop_, BraidStepStatus &pstatus);
 
+  /* Restrict the fine vector fu_ to the next coarser resolution, or copy it
+   * if there is none */
+  braid_Int Coarsen(braid_Vector fu_, braid_Vector *cu_ptr,
+                    BraidCoarsenRefStatus &status);
+
+  /* Interpolate the coarse vector cu_ to the resolution of the level below */
+  braid_Int Refine(braid_Vector cu_, braid_Vector *fu_ptr,
+                   BraidCoarsenRefStatus &status);
+
   /* Compute residual: Does nothing. */
   braid_Int Residual(braid_Vector u_, braid_Vector r_,
                      BraidStepStatus &pstatus);
@@ -139,18 +338,48 @@ class myBraidApp : public BraidApp {
  */
 class myAdjointBraidApp : public myBraidApp {
  protected:
+  myBraidApp *primalapp; /* Primal app, holds the final primal state */
   BraidCore
       *primalcore; /* pointer to primal core for accessing primal states */
+  CheckpointStore *primalstore; /* Primal checkpoints, NULL if the primal
+                                   core stores all states */
+  GradientExchange *gradexchange; /* Averages the gradient over the data
+                                     parallel replicas */
+  MyReal *coarseprimal[2]; /* Primal states restricted to the coarse
+                              resolutions (NULL if not coarsened) */
+
+  /* Restrict a fine primal state to resolution res, returns the state */
+  MyReal *RestrictPrimalState(MyReal *primalstate, int res);
 
  public:
   myAdjointBraidApp(DataSet *Data, Network *Network, Config *config,
-                    BraidCore *Primalcoreptr, MPI_Comm comm);
+                    myBraidApp *Primalapp, MPI_Comm comm);
 
   ~myAdjointBraidApp();
 
   /* Get the storage index of primal (reversed) */
   int GetPrimalIndex(int ts);
 
+  /* Return the exchange of the gradient between the replicas. The gradient
+   * is averaged once wait() has been called on it after a run. */
+  GradientExchange *getGradientExchange();
+
+  /* Return the primal state at a primal time step and its layer */
+  MyReal *GetPrimalState(int primaltimestep, Layer **layer_ptr);
+
+  /* Take the step backwards over the primal layer of primaltimestep on the
+   * primal state, updating the gradient if compute_gradient is set */
+  void ApplyAdjointStep(Layer *primallayer, MyReal *primalstate,
+                        myBraidVector *u, int primaltimestep, MyReal deltaT,
+                        int compute_gradient);
+
+  /* Apply the fine grid adjoint step from time step ts to u, outside of
+   * braid */
+  void StepLocal(myBraidVector *u, int ts, int compute_gradient);
+
+  /* Solve without braid, from the last to the first processor */
+  void RunSerial();
+
   /* Apply one time step */
   braid_Int Step(braid_Vector u_, braid_Vector ustop_, braid_Vector fstop_,
                  BraidStepStatus &pstatus);
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include "compress.hpp"
+#include "config.hpp"
+#include "defs.hpp"
+#include "network.hpp"
+#pragma once
+
+/* Number of recomputed segments kept in the segment cache */
+#define CHECKPOINT_NSEGMENTS 2
+
+/**
+ * Store for the primal states needed by the adjoint, if only every stride-th
+ * state (checkpoint) is kept. The first state on each processor is always a
+ * checkpoint. States between two checkpoints (a segment) are recomputed from
+ * the previous checkpoint when they are requested and are kept in a small
+ * cache of segments.
+ * If the checkpoints are braid's C-points (stride = braid_cfactor0), the
+ * recomputed states match the F-points of the final braid iteration.
+ * Checkpoints can be kept in reduced precision (fp32 or bf16), they are
+ * widened when they are requested.
+ * Optionally, the checkpoints are spilled to a memory mapped scratch file.
+ * Stored checkpoints are written back in the background, and the checkpoint
+ * preceding a requested one is read ahead (the adjoint runs backwards).
+ */
+class CheckpointStore {
+ protected:
+  Network *network; /* Network for recomputing the states */
+  int stride;       /* Distance of the checkpoints */
+  int ilower;       /* First primal time step on this processor */
+  int iupper;       /* Last primal time step on this processor */
+  int nbatch;       /* Number of examples */
+  int nchannels;    /* Width of the network */
+  MyReal T;         /* Final time */
+  int ntime;        /* Number of time steps */
+
+  int precision;       /* Encoding of the checkpoints (see compresstype) */
+  char **checkpoints;  /* Encoded checkpoints, NULL at non-checkpoints */
+  MyReal *widened;     /* Last requested checkpoint in full precision */
+  int widenedstep;     /* Time step of the widened checkpoint, or -1 */
+
+  /* Spill file */
+  int spillfd;       /* File descriptor of the scratch file, -1 if unused */
+  char *spillmap;    /* Mapping of the scratch file */
+  size_t spillsize;  /* Size of the mapping */
+  size_t spillslot;  /* Bytes per checkpoint in the file (whole pages) */
+
+  /* Map the scratch file in directory dir and place the checkpoints in it */
+  void openSpillFile(const char *dir);
+
+  /* Start writing back the checkpoint at time step ts */
+  void writeBehind(int ts);
+
+  /* Advise the kernel to read the checkpoint at time step ts */
+  void readAhead(int ts);
+
+  /* Cache of recomputed segments */
+  int segstart[CHECKPOINT_NSEGMENTS];   /* Checkpoint of the segment, or -1 */
+  int seglastuse[CHECKPOINT_NSEGMENTS]; /* Counter at the last use */
+  MyReal **segstates[CHECKPOINT_NSEGMENTS]; /* States after the checkpoint */
+  int usecounter;                           /* Counts state requests */
+
+  /* Return the checkpoint at or before time step ts */
+  int getCheckpoint(int ts);
+
+  /* Recompute the segment starting at checkpoint into cache slot islot */
+  void recomputeSegment(int checkpoint, int islot);
+
+ public:
+  /* Constructor: Stores the states of the primal time steps
+   * ilower..iupper. */
+  CheckpointStore(Network *network, Config *config, int nbatch, int ilower,
+                  int iupper);
+
+  /* Destructor */
+  ~CheckpointStore();
+
+  /* Returns 1 if the state at time step ts is a checkpoint, 0 else */
+  int isCheckpoint(int ts);
+
+  /* Store the state at time step ts, if it is a checkpoint. Invalidates
+   * the recomputed segments. */
+  void storeState(int ts, MyReal *state);
+
+  /* Return the state at time step ts (nbatch * nchannels, example by
+   * example). Recomputes its segment, if needed. */
+  MyReal *getState(int ts);
+};
@@ -0,0 +1,60 @@
+#include <map>
+#include <tuple>
+#include "config.hpp"
+#include "defs.hpp"
+#include "layer.hpp"
+#include "network.hpp"
+#include "spatialcoarsen.hpp"
+#pragma once
+
+/**
+ * Propagators for the steps on the coarse braid levels. A coarse step from
+ * time step first to time step last stands for the fine layers first ..
+ * last-1. By default braid applies the fine layer first with the coarse step
+ * size. Instead, the step can apply a layer whose weights are the average of
+ * the fine layers, or a low rank approximation of that average (see
+ * LowRankLayer), which is cheaper to apply than the fine layers.
+ * On spatially coarsened levels (see SpatialCoarsening), the step applies a
+ * convolutional layer on the coarse images, whose design is coarsened from
+ * the one of the fine step.
+ * The coarse layers are set up on first use and updated when the design
+ * changes. Fine layers of other processors are taken from the network's
+ * cache of remote layers.
+ */
+class CoarsePropagator {
+ protected:
+  Network *network;           /* Network holding the fine layers */
+  Config *config;             /* Config for creating the coarse layers */
+  SpatialCoarsening *spatial; /* Image resolutions, NULL if not coarsened */
+  int type;                   /* Type of the propagator (see coarseproptype) */
+  int rank;                   /* Rank of the low rank layers */
+  int niter; /* Subspace iterations of the low rank approximation */
+
+  /* Coarse layer of each interval and resolution (first, last, res) and the
+   * design version it has been set up with */
+  std::map<std::tuple<int, int, int>, Layer *> layers;
+  std::map<std::tuple<int, int, int>, int> versions;
+
+  /* Return 1 if the step over first .. last-1 averages the fine layers */
+  int isAveraged(int first, int last);
+
+  /* Set the design of the coarse layer of the interval first .. last at
+   * resolution res */
+  void setDesign(Layer *layer, int first, int last, int res);
+
+ public:
+  CoarsePropagator(Network *network, Config *config,
+                   SpatialCoarsening *spatial);
+
+  ~CoarsePropagator();
+
+  /* Return the type of the propagator */
+  int getType();
+
+  /**
+   * Return the layer for a coarse step over the fine layers first .. last-1
+   * on images of resolution res (0: fine), or NULL if the step is to apply
+   * the fine layer first.
+   */
+  Layer *getLayer(int first, int last, int res);
+};
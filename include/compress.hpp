@@ -0,0 +1,46 @@
+#include <stddef.h>
+#include <stdio.h>
+#include "config.hpp"
+#include "defs.hpp"
+#include "threadpool.hpp"
+
+#pragma once
+
+/**
+ * Compressors for the network state in braid messages. All functions work
+ * on n values of the state and a byte buffer.
+ *  - COMPRESS_NONE:     values are copied as they are
+ *  - COMPRESS_FP32:     values are rounded to single precision
+ *  - COMPRESS_BF16:     values are rounded to bfloat16 (upper 16 bits of fp32)
+ *  - COMPRESS_QUANTIZE: uniform quantization with max. error tol, 8 or 16 bit
+ *                       codes. Falls back to COMPRESS_NONE if tol <= 0 or if
+ *                       16 bits are not enough to represent the range.
+ * The values are processed in chunks on the threads of a pool, if one is
+ * given (NULL: serial). The result doesn't depend on the number of threads.
+ */
+
+/**
+ * Return the maximum number of bytes compressState writes for n values
+ */
+size_t compressBound(int type, int n);
+
+/**
+ * Return the type to compress n values of x with, such that the error of
+ * each value stays below tol: COMPRESS_FP32 and COMPRESS_BF16 fall back to
+ * COMPRESS_NONE if rounding the largest value is less accurate than tol
+ * (e.g. if tol <= 0). Other types are returned as they are.
+ */
+int compressType(int type, MyReal tol, int n, MyReal *x, ThreadPool *threads);
+
+/**
+ * Compress n values of x into buffer. The quantizer keeps the error of each
+ * value below tol. Returns the number of bytes written.
+ */
+size_t compressState(int type, MyReal tol, int n, MyReal *x, char *buffer,
+                     ThreadPool *threads);
+
+/**
+ * Decompress n values from a buffer written by compressState into x
+ */
+void decompressState(int type, int n, char *buffer, MyReal *x,
+                     ThreadPool *threads);
@@ -21,6 +21,42 @@ enum hessiantype { BFGS_SERIAL, LBFGS, IDENTITY };
 /* Available stepsize selection methods */
 enum stepsizetype { FIXED, BACKTRACKINGLS, ONEOVERK };
 
+/* Available compression types for braid messages */
+enum compresstype {
+  COMPRESS_NONE,
+  COMPRESS_FP32,
+  COMPRESS_BF16,
+  COMPRESS_QUANTIZE
+};
+
+/* Available compression types for the gradient exchange between replicas */
+enum gradcompresstype {
+  GRADCOMPRESS_NONE,
+  GRADCOMPRESS_FP32,
+  GRADCOMPRESS_BF16,
+  GRADCOMPRESS_TOPK
+};
+
+/* Available policies for binding the threads of a processor to cores */
+enum pinningtype { PIN_NONE, PIN_COMPACT, PIN_SCATTER };
+
+/* Available propagators on the coarse braid levels */
+enum coarseproptype {
+  COARSEPROP_LAYER,
+  COARSEPROP_AVERAGE,
+  COARSEPROP_LOWRANK
+};
+
+/* Available initial guesses of the braid solves of the training */
+enum warmstarttype {
+  WARMSTART_NONE,
+  WARMSTART_GRID,
+  WARMSTART_SWEEP
+};
+
+/* Available choices of sweeps over the layers instead of braid */
+enum serialtype { SERIAL_OFF, SERIAL_ON, SERIAL_AUTO };
+
 class Config {
  private:
   /* Linked list for reading config options */
@@ -65,19 +101,46 @@ class Config {
   int braid_cfactor;
   int braid_maxlevels;
   int braid_mincoarse;
+  int braid_mincoarseproc;
   int braid_maxiter;
   MyReal braid_abstol;
   MyReal braid_abstoladj;
+  int braid_maxiteradj;
+  int braid_inexact;
+  MyReal braid_inexactfactor;
   int braid_printlevel;
   int braid_accesslevel;
   int braid_setskip;
   int braid_fmg;
   int braid_nrelax;
   int braid_nrelax0;
+  int braid_compress;
+  MyReal braid_compresstol;
+  int braid_shmslots;
+  int braid_checkpoint;
+  int braid_primalstore;
+  const char *braid_spilldir;
+  int braid_nthreads;
+  int braid_ftasks;
+  int braid_progress;
+  int braid_progresscompare;
+  int braid_pinning;
+  int braid_hugepages;
+  int braid_coarseprop;
+  int braid_coarserank;
+  int braid_spatialcoarsen;
+  int braid_warmstart;
+  int braid_serial;
 
   /* Optimization */
   int batch_type;
   int nbatch;
+  int nreplicas;
+  int ntensor;
+  int gradient_bucketsize;
+  int gradient_compress;
+  MyReal gradient_topk;
+  int gradient_verify;
   MyReal gamma_tik;
   MyReal gamma_ddt;
   MyReal gamma_class;
@@ -87,6 +150,8 @@ class Config {
   MyReal gtol;
   int ls_maxiter;
   MyReal ls_factor;
+  int optim_oneshot;
+  MyReal optim_oneshotrtol;
   int hessianapprox_type;
   int lbfgs_stages;
   int validationlevel;
@@ -106,4 +171,10 @@ class Config {
   /* Returns a stepsize, depending on the selected stepsize type and current
    * optimization iteration */
   MyReal getStepsize(int optimiter);
+
+  /* Returns the braid tolerance of the primal (adjoint = 0) or adjoint
+   * (adjoint = 1) solves of an optimization iteration. With braid_inexact,
+   * the tolerance is relative to the gradient norm gnorm of the previous
+   * iteration (gnorm < 0: none yet), but not below the fixed tolerance. */
+  MyReal getBraidTol(int adjoint, MyReal gnorm);
 };
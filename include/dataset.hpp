@@ -2,6 +2,7 @@
 #include <mpi.h>
 #include "config.hpp"
 #include "defs.hpp"
+#include "threadpool.hpp"
 #include "util.hpp"
 #pragma once
 
@@ -13,9 +14,18 @@ class DataSet {
 
   MyReal **examples; /* Array of Feature vectors (dim: nelements x nfeatures) */
   MyReal **labels;   /* Array of Label vectors (dim: nelements x nlabels) */
+  MyReal *exampledata; /* Contiguous storage of the feature vectors */
+  MyReal *labeldata;   /* Contiguous storage of the label vectors */
 
-  int nbatch;    /* Size of the batch */
-  int *batchIDs; /* Array of batch indicees */
+  int nbatch;    /* Size of this replica's shard of the batch */
+  int *batchIDs; /* Array of batch indicees (of all replicas) */
+
+  int nbatchglobal;     /* Size of the batch of all replicas */
+  int batchoffset;      /* Position of this replica's shard in the batch */
+  int nreplicas;        /* Number of data parallel replicas */
+  int ireplica;         /* Index of this processor's replica */
+  MPI_Comm replicacomm; /* Processors of all replicas that hold the same
+                           layers as this one */
 
   int MPIsize; /* Size of the global communicator */
   int MPIrank; /* Processors rank */
@@ -31,12 +41,35 @@ class DataSet {
   /* Destructor */
   ~DataSet();
 
+  /* Allocate the data. The rows are first touched by the threads of the
+   * pool that apply the layers to them. */
   void initialize(int nElements, int nFeatures, int nLabels, int nBatch,
-                  MPI_Comm Comm);
+                  MPI_Comm Comm, ThreadPool *threads);
+
+  /**
+   * Split the batch into one shard per data parallel replica. ReplicaComm
+   * holds one processor of each replica, in replica order. Call this after
+   * initialize().
+   */
+  void setReplicas(MPI_Comm ReplicaComm);
 
-  /* Return the batch size*/
+  /* Return the batch size of this replica */
   int getnBatch();
 
+  /* Return the share of this replica in the batch (nbatch / nbatchglobal) */
+  MyReal getReplicaWeight();
+
+  /**
+   * Collective on the replica communicator: Return the sum over all replicas
+   * of value, weighted with each replica's share of the batch. For a
+   * quantity that is averaged over the examples of a shard, such as the loss
+   * or the gradient, this gives the average over the full batch.
+   */
+  MyReal reduceReplicas(MyReal value);
+
+  /* Return the communicator joining the replicas */
+  MPI_Comm getReplicaComm();
+
   /* Return the feature vector of a certain batchID. If not stored on this
    * processor, return NULL */
   MyReal *getExample(int id);
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <string.h>
+#include "defs.hpp"
+#include "layer.hpp"
+#include "network.hpp"
+#include "threadpool.hpp"
+#pragma once
+
+/**
+ * Speculative F-relaxation on the fine grid. When braid starts a sweep over
+ * the F-intervals of this processor's layer block, all intervals are
+ * computed at once as independent tasks on the network's thread pool, each
+ * starting from its current C-point value. The following Step calls of the
+ * sweep take the results from here.
+ * A result is only used if the step's input state is bitwise equal to the
+ * one the task started from, and if the layer, the time step size and the
+ * design version match. Otherwise the step is computed as usual.
+ */
+class FIntervalTasks {
+ protected:
+  Network *network; /* Network holding the layers and the thread pool */
+  int nbatch;       /* Number of examples */
+  int nchannels;    /* Width of the network */
+  int cfactor;      /* Coarsening factor on the fine grid */
+  int ntime;        /* Number of fine grid time steps */
+  MyReal T;         /* Final time */
+
+  int ilower;     /* First time step of the block */
+  int iupper;     /* Last time step of the block */
+  int nsteps;     /* Number of steps from one point of the block to the
+                     next (iupper - ilower) */
+  MyReal **input; /* State before each step */
+  MyReal **output; /* State after each step, inside of an interval this is
+                      the input of the next step */
+  int *valid;      /* Flag: 1 if the step has been computed */
+  Layer **layers;  /* Layer of each step */
+  MyReal *dts;     /* Time step size of each step */
+  int version;     /* Design version of the computed steps */
+
+  /* Set up the storage for the steps of the block ilower..iupper */
+  void allocate(int Ilower, int Iupper);
+
+  /* Free the storage */
+  void deallocate();
+
+ public:
+  FIntervalTasks(Network *network, int nbatch, int nchannels, int cfactor,
+                 int ntime, MyReal T);
+
+  ~FIntervalTasks();
+
+  /* Return the coarsening factor */
+  int getCFactor();
+
+  /* Return the first C-point of the block starting at time step Ilower */
+  int getFirstCPoint(int Ilower);
+
+  /* Return the number of C-points of the block Ilower..Iupper that start an
+   * interval on this processor */
+  int getnIntervals(int Ilower, int Iupper);
+
+  /**
+   * Compute the intervals of the block Ilower..Iupper in parallel. cstates
+   * holds the current value at each C-point (in the order of the C-points).
+   * Intervals whose C-point value is NULL are skipped.
+   */
+  void launch(int Ilower, int Iupper, MyReal **cstates);
+
+  /**
+   * Apply the step from time step ts to the state, using a computed
+   * interval. Returns 1 on success, 0 if the step has to be computed.
+   */
+  int apply(int ts, Layer *layer, MyReal dt, MyReal *state);
+};
@@ -0,0 +1,81 @@
+#include <mpi.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "compress.hpp"
+#include "config.hpp"
+#include "dataset.hpp"
+#include "defs.hpp"
+#include "network.hpp"
+#pragma once
+
+/**
+ * Non-blocking average of the gradient over the data parallel replicas.
+ * Parts of the gradient are exchanged as soon as they are final, in buckets
+ * of at most bucketsize entries, while the processor goes on computing. Each
+ * replica's part is weighted with its share of the batch (see
+ * DataSet::reduceReplicas). All replicas must start the same parts in the
+ * same order.
+ * Buckets can be compressed (fp32, bf16 or top-k). Compressed buckets of all
+ * replicas are gathered and summed in replica order, so all replicas get the
+ * same gradient. The compression error of each bucket is kept and added to
+ * the bucket in the next exchange (error feedback).
+ */
+class GradientExchange {
+ protected:
+  /* One bucket of the exchange, kept from one exchange to the next */
+  struct Bucket {
+    MyReal *values;   /* Gradient entries, averaged in place */
+    int count;        /* Number of entries */
+    size_t nbytes;    /* Size of a compressed bucket */
+    char *sendbuf;    /* Compressed entries of this replica */
+    char *recvbuf;    /* Compressed entries of all replicas */
+    MyReal *residual; /* Compression error of the last exchange */
+    MyReal *exact;    /* Uncompressed average, if verified */
+  };
+
+  DataSet *data;    /* Data set defining the replicas and their weights */
+  Network *network; /* Network holding the layer-parallel communicator */
+  int bucketsize;   /* Maximum number of entries per bucket (0: no limit) */
+  int compress;     /* Compression type (gradcompresstype) */
+  MyReal topk;      /* Fraction of the entries sent by top-k */
+  int verify;       /* Flag: 1 if the exact average is computed, too */
+
+  std::vector<Bucket> buckets;       /* Buckets in the order of start() */
+  int nstarted;                      /* Buckets started since last wait() */
+  int active;                        /* Flag: 1 if start() was called since
+                                        the last wait() */
+  std::vector<MPI_Request> requests; /* Pending bucket exchanges */
+  MyReal waittime;                   /* Time spent waiting */
+  MyReal relerror;  /* Relative error of the last compressed average */
+  MyReal exactnorm; /* Norm of the last exact average */
+
+  /* Compress the entries of a bucket plus its residual into sendbuf and
+   * keep the new compression error in the residual */
+  void compressBucket(Bucket *bucket);
+
+  /* Add the compressed entries in buffer to the values of a bucket */
+  void addBucket(Bucket *bucket, char *buffer);
+
+ public:
+  GradientExchange(DataSet *data, Network *network, Config *config);
+
+  /* Destructor: Waits for pending exchanges */
+  ~GradientExchange();
+
+  /* Start averaging the n entries of values in place. values must not be
+   * accessed until wait() returns. */
+  void start(int n, MyReal *values);
+
+  /* Wait until all started parts are averaged. Collective on the network's
+   * communicator if the compression is verified. */
+  void wait();
+
+  /* Return the time spent in wait() */
+  MyReal getWaitTime();
+
+  /* Return the relative error of the compressed gradient and the norm of
+   * the exact gradient of the last exchange (if verified) */
+  void getVerification(MyReal *relerror_ptr, MyReal *exactnorm_ptr);
+};
@@ -5,6 +5,7 @@
 #include "config.hpp"
 #include "defs.hpp"
 #include "linalg.hpp"
+#include "threadpool.hpp"
 
 #pragma once
 
@@ -37,8 +38,36 @@ class Layer {
   int activ;        /* Activaation function (enum element) */
   int type;         /* Type of the layer (enum element) */
 
-  MyReal *update;     /* Auxilliary for computing fwd update */
-  MyReal *update_bar; /* Auxilliary for computing bwd update */
+  int nthreads; /* Number of threads applying the layer concurrently */
+  MyReal *update_threads;     /* Auxilliary for fwd update (per thread) */
+  MyReal *update_bar_threads; /* Auxilliary for bwd update (per thread) */
+  MyReal *bar_threads; /* Derivative of weights and bias accumulated by the
+                          threads 1..nthreads-1 (thread 0 uses weights_bar
+                          and bias_bar) */
+
+  MPI_Comm tensorcomm; /* Processors sharing the outputs of the layer */
+  int ntensor;         /* Number of processors in tensorcomm */
+  int itensor;         /* Rank of this processor in tensorcomm */
+  int tensorunit;      /* Number of values of an output slice (channel) */
+  int tensorfirst;     /* First output slice computed on this processor */
+  int tensorlast;      /* End of the output slices of this processor */
+  MyReal *tensorbuf;   /* Buffer for exchanging the output slices */
+  int tensorbufsize;   /* Size of tensorbuf */
+
+  /* Return the output slices [first, last) of rank in tensorcomm */
+  void getTensorSlices(int rank, int *first, int *last);
+
+  /* Set the values of a state outside this processor's slices to zero, so
+   * that only this processor contributes them to sumTensorSlices */
+  void clearOtherTensorSlices(MyReal *state);
+
+  /* Return the auxilliaries of the calling thread */
+  MyReal *getUpdate();
+  MyReal *getUpdateBar();
+
+  /* Return the derivative of weights and bias of the calling thread */
+  MyReal *getThreadWeightsBar();
+  MyReal *getThreadBiasBar();
 
  public:
   /* Available layer types */
@@ -49,7 +78,8 @@ class Layer {
     CLASSIFICATION = 3,
     OPENCONV = 4,
     OPENCONVMNIST = 5,
-    CONVOLUTION = 6
+    CONVOLUTION = 6,
+    LOWRANK = 7
   };
 
   Layer();
@@ -62,9 +92,48 @@ class Layer {
   /* Set time step size */
   void setDt(MyReal DT);
 
+  /* Set the number of threads that apply the layer concurrently (see
+   * ThreadPool). Allocates the per-thread auxilliaries. */
+  virtual void setnThreads(int nThreads);
+
   /* Set design and gradient memory location */
   void setMemory(MyReal *design_memloc, MyReal *gradient_memloc);
 
+  /**
+   * Split the output slices (channels) of the layer among the processors of
+   * comm (tensor parallelism). applyFWD then only updates this processor's
+   * slices of the state, which are exchanged by gatherTensorSlices.
+   * applyBWD only differentiates the outputs of this processor's slices. It
+   * leaves a partial adjoint of all slices, which is summed by
+   * sumTensorSlices, and a partial derivative of the weights, which is
+   * summed by reduceTensorGradient.
+   */
+  void setTensorComm(MPI_Comm comm);
+
+  /* Return the number of processors sharing the outputs of the layer */
+  int getnTensor();
+
+  /**
+   * Collective on the tensor communicator (main thread only): Exchange the
+   * slices of nbatch states or adjoints of dim_Out values, stored one after
+   * the other, after the layer has been applied to them.
+   */
+  void gatherTensorSlices(int nbatch, MyReal *states);
+
+  /**
+   * Collective on the tensor communicator (main thread only): Sum the
+   * partial adjoints of nbatch examples of dim_In values, stored one after
+   * the other, after applyBWD.
+   */
+  void sumTensorSlices(int nbatch, MyReal *states);
+
+  /**
+   * Collective on the tensor communicator (main thread only): Sum the
+   * derivatives of weights and bias of all processors, after applyBWD and
+   * reduceBar.
+   */
+  void reduceTensorGradient();
+
   /* Some Get..() functions */
   MyReal getDt();
   MyReal getGammaTik();
@@ -90,6 +159,9 @@ class Layer {
   int getnConv();
   int getCSize();
 
+  /* Predicted cost of applying the layer to one example (multiply-adds) */
+  MyReal getCost();
+
   /* Get the layer index (i.e. the time step) */
   int getIndex();
 
@@ -118,6 +190,13 @@ class Layer {
    */
   void resetBar();
 
+  /**
+   * Adds the derivatives accumulated by the threads to the bar variables, in
+   * thread order, and resets the per-thread derivatives to zero.
+   * Call after applyBWD has been applied in parallel.
+   */
+  void reduceBar();
+
   /**
    * Evaluate Tikhonov Regularization
    * Returns 1/2 * \|weights||^2 + 1/2 * \|bias\|^2
@@ -196,18 +275,56 @@ class DenseLayer : public Layer {
   void applyBWD(MyReal *state, MyReal *state_bar, int compute_gradient);
 };
 
+/**
+ * Layer using a low rank weight matrix W = U V^T, U, V \in R^{nxr}
+ * Layer transformation: y = y + dt * sigma(U V^T y + b)
+ * Weights are stored as U followed by V (row-wise). Used as a cheap
+ * propagator on coarse braid levels.
+ */
+class LowRankLayer : public Layer {
+ protected:
+  int rank;             /* Rank r of the weight matrix */
+  MyReal *rank_threads; /* Auxilliary for V^T y and its derivative (per
+                           thread) */
+
+  /* Return the auxilliary of the calling thread (2 * rank values) */
+  MyReal *getRankAux();
+
+ public:
+  LowRankLayer(int idx, int dim, int Rank, MyReal deltaT, int activation);
+  ~LowRankLayer();
+
+  void setnThreads(int nThreads);
+
+  /* Return the rank */
+  int getRank();
+
+  /**
+   * Set U and V such that U V^T approximates the dense n x n matrix W
+   * (row-wise), by niter steps of a subspace iteration on W W^T. U has
+   * orthonormal columns and V = W^T U. The bias is set to b.
+   */
+  void approximate(MyReal *W, MyReal b, int niter);
+
+  void applyFWD(MyReal *state);
+
+  void applyBWD(MyReal *state, MyReal *state_bar, int compute_gradient);
+};
+
 /**
  * Opening Layer using dense weight matrix K \in R^{nxn}
  * Layer transformation: y = sigma(W*y_ex + b)  for examples y_ex \in \R^dimI
  */
 class OpenDenseLayer : public DenseLayer {
  protected:
-  MyReal *example; /* Pointer to the current example data */
+  MyReal **examples; /* Pointers to the current example data (per thread) */
 
  public:
   OpenDenseLayer(int dimI, int dimO, int activation, MyReal gammatik);
   ~OpenDenseLayer();
 
+  void setnThreads(int nThreads);
+
   void setExample(MyReal *example_ptr);
 
   void applyFWD(MyReal *state);
@@ -220,11 +337,13 @@ class OpenDenseLayer : public DenseLayer {
  */
 class OpenExpandZero : public Layer {
  protected:
-  MyReal *example; /* Pointer to the current example data */
+  MyReal **examples; /* Pointers to the current example data (per thread) */
  public:
   OpenExpandZero(int dimI, int dimO);
   ~OpenExpandZero();
 
+  void setnThreads(int nThreads);
+
   void setExample(MyReal *example_ptr);
 
   void applyFWD(MyReal *state);
@@ -237,14 +356,17 @@ class OpenExpandZero : public Layer {
  */
 class ClassificationLayer : public Layer {
  protected:
-  MyReal *label; /* Pointer to the current label vector */
+  MyReal **labels; /* Pointers to the current label vector (per thread) */
 
-  MyReal *probability; /* vector of pedicted class probabilities */
+  MyReal *probability; /* vector of pedicted class probabilities (per
+                          thread) */
 
  public:
   ClassificationLayer(int idx, int dimI, int dimO, MyReal gammatik);
   ~ClassificationLayer();
 
+  void setnThreads(int nThreads);
+
   void setLabel(MyReal *label_ptr);
 
   void applyFWD(MyReal *state);
@@ -313,7 +435,9 @@ class ConvLayer : public Layer {
       MyReal *state,    // state vector to apply convolution to
       int output_conv,  // output convolution
       int j,            // row index
-      int k);           // column index
+      int k,            // column index
+      int first,        // first image of state to sum over
+      int last);        // end of the images of state to sum over
 
   /**
    * This method is designed to be used only in the applyBWD. It computes the
@@ -331,15 +455,19 @@ class ConvLayer : public Layer {
    * Where state_bar _must_ be at the old time. Note that the adjoint variable
    * state_bar carries withit all the information of the objective derivative.
    *
-   * On exit this method modifies weights_bar
+   * On exit this method modifies weights_bar (the one of the calling
+   * thread, passed in wbar)
    */
   inline MyReal updateWeightDerivative(
       MyReal *state,  // state vector
       MyReal
           *update_bar,  // combines derivative and adjoint info (see comments)
+      MyReal *wbar,     // derivative of the weights
       int output_conv,  // output convolution
       int j,            // row index
-      int k);           // column index
+      int k,            // column index
+      int first,        // first image of update_bar to sum over
+      int last);        // end of the images of update_bar to sum over
 };
 
 /**
@@ -348,12 +476,14 @@ class ConvLayer : public Layer {
  */
 class OpenConvLayer : public Layer {
  protected:
-  MyReal *example; /* Pointer to the current example data */
+  MyReal **examples; /* Pointers to the current example data (per thread) */
 
  public:
   OpenConvLayer(int dimI, int dimO);
   ~OpenConvLayer();
 
+  void setnThreads(int nThreads);
+
   void setExample(MyReal *example_ptr);
 
   void applyFWD(MyReal *state);
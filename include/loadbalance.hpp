@@ -0,0 +1,71 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <vector>
+#include "braid_wrapper.hpp"
+#include "defs.hpp"
+#include "network.hpp"
+#pragma once
+
+/**
+ * Distribution of the primal time points 0 .. ntime to the processors of the
+ * layer communicator. Braid splits the points into blocks of equal length,
+ * which overloads the first and the last processor if the opening layer at
+ * point 0 or the classification at point ntime is expensive compared to the
+ * intermediate layers. Weighted blocks instead balance the cost of the
+ * points, which is either measured by the braid apps (see
+ * myBraidApp::CountPoint) or predicted from the shape of the layers (see
+ * Layer::getCost).
+ * Braid sets up its grid from its own distribution, and the network blocks
+ * have to follow it. The weighted blocks are therefore reported along with
+ * the imbalance they would remove, e.g. for choosing the number of
+ * processors or the network depth.
+ */
+class LoadBalance {
+ protected:
+  Network *network; /* Network holding the layers of this processor */
+  MPI_Comm comm;    /* Processors sharing the time points */
+  int npoints;      /* Number of time points (ntime + 1) */
+  int ilower;       /* First time point of this processor */
+  int iupper;       /* Last time point of this processor */
+  int nblocks;      /* Number of processors */
+
+  /* Collective: first point of each processor, and npoints at the end */
+  std::vector<int> firsts;
+
+  /* Return the cost of the point blocks starting at Firsts, divided by the
+   * mean cost of the blocks */
+  MyReal getImbalance(const std::vector<MyReal> &costs,
+                      const std::vector<int> &Firsts);
+
+  /* Write the imbalance of braid's and of the weighted blocks for the costs
+   * of the points to outfile */
+  void writeBlocks(FILE *outfile, const char *name,
+                   const std::vector<MyReal> &costs);
+
+ public:
+  /* Constructor, collective on Comm. Ilower and Iupper are the time points
+   * of this processor. */
+  LoadBalance(Network *Network, int Ilower, int Iupper, MPI_Comm Comm);
+
+  /**
+   * Return the first point of each of the nblocks contiguous blocks of the
+   * points, and npoints at the end. The blocks minimize the max. cost of a
+   * block, and each one gets at least one point (if there are enough).
+   */
+  static std::vector<int> getWeightedBlocks(const std::vector<MyReal> &costs,
+                                            int nblocks);
+
+  /* Collective: Return the predicted cost of all points, from the layers of
+   * the network blocks */
+  std::vector<MyReal> getModelCosts();
+
+  /* Collective: Return the measured cost of all points, from the time spent
+   * on them in the primal and adjoint runs */
+  std::vector<MyReal> getMeasuredCosts(myBraidApp *primalapp,
+                                       myBraidApp *adjointapp);
+
+  /* Collective: Writes the imbalance of braid's blocks and the weighted
+   * blocks for the measured and the predicted costs to outfile on rank 0 */
+  void writeReport(FILE *outfile, myBraidApp *primalapp,
+                   myBraidApp *adjointapp);
+};
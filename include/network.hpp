@@ -6,6 +6,7 @@
 #include "config.hpp"
 #include "dataset.hpp"
 #include "layer.hpp"
+#include "threadpool.hpp"
 #include "util.hpp"
 #pragma once
 
@@ -37,13 +38,48 @@ class Network {
   Layer *layer_left; /* Copy of last layer of left-neighbouring processor */
   Layer *layer_right; /* Copy of first layer of right-neighbouring processor */
 
-  MPI_Comm comm; /* MPI communicator */
+  int designversion; /* Counts the updates of the design */
+  int *layer_owner;  /* Processor storing a layer (all layers, index + 1) */
+  int *layer_offset; /* Position of a layer in the owner's design vector */
+  MPI_Win designwin; /* RMA window exposing the local design vector */
+
+  Layer **layer_cache; /* Copies of remote layers (all layers, index + 1) */
+  int *layer_cache_version; /* Design version of the cached layers */
+  Config *netconfig;        /* Config the network has been created with */
+
+  MPI_Request ghostreq[4]; /* Persistent requests of the ghost layer exchange */
+  int nghostreq;           /* Number of ghost layer requests */
+  int ghostinflight;       /* Flag: 1 while the ghost layers are in flight */
+
+  ThreadPool *threads; /* Threads for the loops over the examples */
+
+  /* Timing of the communication */
+  MyReal ghostwaittime[2]; /* Time spent waiting for the ghost layers,
+                              without (0) and with (1) progress calls */
+  MyReal progresstime;     /* Time spent in progress calls */
+  int nprogress;           /* Number of progress calls */
+  int progressinterval;    /* Examples between progress calls (0: off) */
+  int progresson;          /* Flag: 1 while the progress calls are made */
+
+  MPI_Comm comm;       /* MPI communicator */
+  MPI_Comm tensorcomm; /* Processors sharing the intermediate layers (tensor
+                          parallel), MPI_COMM_NULL if not split */
 
  public:
   Network();
 
   ~Network();
 
+  /* Start the thread pool for the loops over the examples. Called before
+   * the data sets and the network block are set up, so that their arrays are
+   * first touched by the pool's threads. */
+  void createThreadPool(Config *config);
+
+  /* Split the outputs of the intermediate layers among the processors of
+   * TensorComm (see Layer::setTensorComm). Called before the network block
+   * is set up. */
+  void setTensorComm(MPI_Comm TensorComm);
+
   void createNetworkBlock(int StartLayerID, int EndLayerID, Config *config,
                           MPI_Comm Comm);
 
@@ -92,9 +128,16 @@ class Network {
   /* Return MPI communicator */
   MPI_Comm getComm();
 
+  /* Return the current design version (incremented with every update) */
+  int getDesignVersion();
+
+  /* Return the thread pool for the loops over the examples */
+  ThreadPool *getThreadPool();
+
   /**
    * Get the layer at a certain layer index, i.e. a certain time step
    * Returns NULL, if this layer is not stored on this processor
+   * Waits for ghost layers that are still in flight.
    */
   Layer *getLayer(int layerindex);
 
@@ -107,10 +150,56 @@ class Network {
 
   Layer *createLayer(int index, Config *config);
 
+  /**
+   * Get a layer that may be stored on another processor. Local and
+   * neighbouring layers are returned directly. Other layers are kept in a
+   * cache and their design is fetched from the owner once per design version.
+   */
+  Layer *getRemoteLayer(int layerindex, int version);
+
   /* Replace the layer with one that is received from the left neighbouring
    * processor */
   void MPI_CommunicateNeighbours(MPI_Comm comm);
 
+  /**
+   * Start the exchange of the ghost layers with the neighbouring processors.
+   * The designs are sent and received in place with persistent requests.
+   * The exchange is finished when a ghost layer is accessed (see getLayer).
+   */
+  void startGhostExchange();
+
+  /* Wait until the ghost layers are received */
+  void finishGhostExchange();
+
+  /**
+   * Collective on comm: makes the local design visible in designwin and
+   * waits until all processors have done so. Called after each change of
+   * the design, so that getRemoteLayer never fetches an outdated design for
+   * the current version.
+   */
+  void publishDesign();
+
+  /* Wait for the layer, if it is a ghost layer that is still in flight */
+  void waitForLayer(int layerindex);
+
+  /**
+   * Let MPI progress pending messages (ghost layers and braid messages)
+   * while the examples are computed. Called from the loops over the
+   * examples on the main thread, if braid_progress is set.
+   */
+  void progressCommunication();
+
+  /* Switch the progress calls on (1) or off (0), if braid_progress is set */
+  void setProgress(int on);
+
+  /* Return 1 while the progress calls are made, 0 otherwise */
+  int getProgress();
+
+  /* Get the communication timings of this processor. ghostwait gets the
+   * ghost layer wait without (0) and with (1) progress calls. */
+  void getCommTimings(MyReal ghostwait[2], MyReal *progress_ptr,
+                      int *nprogress_ptr);
+
   /**
    * Applies the classification and evaluates loss/accuracy
    */
@@ -0,0 +1,56 @@
+#include <mpi.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <atomic>
+#include "defs.hpp"
+#pragma once
+
+/**
+ * Intra-node transport for braid vectors over an MPI shared memory window.
+ * Each rank owns nslots slots in the window, each holding one network state.
+ * A sender copies the state into one of its free slots and only sends the
+ * slot's address (owner and slot index). The receiver reads the state
+ * in place and releases the slot when the vector is freed.
+ * Slots that are in use are marked by a flag in shared memory, which is set
+ * by the owner and cleared by the receiver.
+ */
+class ShmTransport {
+ protected:
+  int nslots;      /* Number of slots per rank */
+  size_t slotsize; /* Bytes per slot (flag and state) */
+
+  MPI_Comm nodecomm; /* Communicator of the ranks on this node */
+  MPI_Win win;       /* Shared memory window holding the slots */
+  int *noderank;     /* Node rank of each rank in comm, -1 if off-node */
+  char **segment;    /* Start of each node rank's slots */
+
+  /* Return the flag of a slot */
+  std::atomic<int> *getFlag(int noderank, int slot);
+
+ public:
+  /* Constructor: Allocates nslots slots of statesize bytes on each rank of
+   * comm (collective). Nothing is allocated if nslots <= 0. */
+  ShmTransport(MPI_Comm comm, int nslots, size_t statesize);
+
+  /* Destructor (collective) */
+  ~ShmTransport();
+
+  /* Returns 1, if ranks first to last of comm are on this node, 0 else */
+  int onNode(int first, int last);
+
+  /* Takes a free slot of this rank. Returns its index, or -1 if all slots
+   * are in use. */
+  int acquireSlot();
+
+  /* Returns the state stored in a slot. Owner is the rank in comm. */
+  MyReal *getSlotData(int owner, int slot);
+
+  /* Makes the state written into a slot visible to the other ranks */
+  void publishSlot();
+
+  /* Makes states written by other ranks visible to this rank */
+  void syncSlots();
+
+  /* Returns a slot to its owner */
+  void releaseSlot(int owner, int slot);
+};
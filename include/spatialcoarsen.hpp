@@ -0,0 +1,57 @@
+#include "defs.hpp"
+#pragma once
+
+/**
+ * Spatial coarsening of the states of convolutional networks on the coarse
+ * braid levels. A state holds nconv square images per example. On each
+ * coarser resolution the image side is halved (rounded up), until a given
+ * number of halvings or a side of 3 pixels is reached.
+ * Restriction averages the fine pixels of each 2x2 block, interpolation
+ * copies a coarse pixel to the fine pixels of its block. The 3x3 kernels of
+ * a convolutional layer are coarsened to the Galerkin kernels R K P, the
+ * bias image is restricted.
+ */
+class SpatialCoarsening {
+ protected:
+  int nconv;  /* Number of images per example */
+  int nres;   /* Number of resolutions (including the fine one) */
+  int *sides; /* Image side of each resolution, sides[0] is the fine one */
+
+  /* Restrict one image from resolution res to res+1 */
+  void restrictImage(int res, MyReal *fine, MyReal *coarse);
+
+ public:
+  /* Constructor: nChannels = nconv * nFeatures, the images have nFeatures
+   * pixels. At most nHalvings coarser resolutions are set up. */
+  SpatialCoarsening(int nChannels, int nFeatures, int nHalvings);
+
+  ~SpatialCoarsening();
+
+  /* Return the number of images per example */
+  int getnConv();
+
+  /* Return the number of resolutions */
+  int getnResolutions();
+
+  /* Return the image side of a resolution */
+  int getSide(int res);
+
+  /* Return the number of values of one example at a resolution */
+  int getnChannels(int res);
+
+  /* Return the resolution with nChannels values per example, -1 if there is
+   * none */
+  int getResolution(int nChannels);
+
+  /* Restrict one example from resolution res to res+1 */
+  void restrict(int res, MyReal *fine, MyReal *coarse);
+
+  /* Interpolate one example from resolution res+1 to res */
+  void interpolate(int res, MyReal *coarse, MyReal *fine);
+
+  /**
+   * Coarsen the design of a convolutional layer (nconv x nconv kernels of
+   * 3x3 weights, followed by the bias image) from resolution res to res+1.
+   */
+  void coarsenDesign(int res, MyReal *fine, MyReal *coarse);
+};
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "defs.hpp"
+#pragma once
+
+/**
+ * Persistent pool of worker threads for the loops over the examples of a
+ * batch. The range of a loop is split into one contiguous chunk per thread,
+ * which only depends on the loop length and the number of threads. Partial
+ * results that are combined in thread order are thus reproducible.
+ * Only the calling (main) thread may issue loops and call MPI.
+ * The threads can be bound to the cores the processor may run on, and the
+ * pool allocates arrays whose pages are first touched by the threads that
+ * compute on them, so they are placed on these threads' NUMA nodes.
+ */
+class ThreadPool {
+ protected:
+  int nthreads;                     /* Number of threads (including caller) */
+  std::vector<std::thread> workers; /* Worker threads 1 .. nthreads-1 */
+
+  std::mutex mutex;             /* Protects the fields below */
+  std::condition_variable wake; /* Signals a new loop to the workers */
+  std::condition_variable done; /* Signals the end of a chunk to the caller */
+  int generation;               /* Counts the loops issued */
+  int nbusy;                    /* Number of workers still running a chunk */
+  int stop;                     /* Flag: 1 if the workers should exit */
+
+  int length; /* Length of the current loop */
+  const std::function<void(int, int)> *body; /* Body of the current loop */
+
+  int progressinterval;           /* Loop items between progress calls */
+  std::function<void()> progress; /* Progress call, e.g. for MPI */
+
+  int hugepages;         /* Flag: 1 if large arrays use huge pages */
+  std::vector<int> cpus; /* Core of each thread, -1 if not bound */
+
+  /* Bind the threads to the allowed cores following the pinning policy */
+  void bind(int pinning);
+
+  /* Thread index of the calling thread (0 on the main thread) */
+  static thread_local int threadid;
+
+  /* Main function of worker thread tid */
+  void work(int tid);
+
+  /* Returns the bounds [first, last) of the chunk of thread tid */
+  void getChunk(int tid, int n, int *first, int *last);
+
+  /* Calls body on the caller's chunk, with progress calls in between */
+  void runChunk(int first, int last, const std::function<void(int, int)> &f);
+
+ public:
+  /* Constructor: Starts nThreads-1 workers (none if nThreads <= 1) and
+   * binds all threads following the pinningtype Pinning. Arrays from
+   * allocate() are backed by huge pages if HugePages is 1. */
+  ThreadPool(int nThreads, int Pinning, int HugePages);
+
+  /* Destructor: Joins the workers */
+  ~ThreadPool();
+
+  /* Returns the number of threads */
+  int getnThreads();
+
+  /* Returns the index of the calling thread in [0, nthreads) */
+  static int getThreadID();
+
+  /* Returns the core thread tid is bound to, -1 if it is not bound */
+  int getCPU(int tid);
+
+  /* Collective on comm: Writes the cores of the threads of all processors
+   * to outfile on rank 0, one line per processor. */
+  void writeBinding(FILE *outfile, MPI_Comm comm);
+
+  /* Returns a zeroed array of nrows rows of rowsize values. The rows are
+   * first touched by the threads whose loop chunks cover them. */
+  MyReal *allocate(int nrows, int rowsize);
+
+  /* Frees an array returned by allocate() */
+  static void deallocate(MyReal *data);
+
+  /* Let the calling thread call hook after every interval items of its
+   * chunk of a loop (interval <= 0: never). The loop body is then called
+   * on sub-chunks. */
+  void setProgress(int interval, const std::function<void()> &hook);
+
+  /* Calls body(first, last) for the chunks of [0, n) in parallel and
+   * returns when all chunks are done. The caller processes chunk 0. */
+  void parallelFor(int n, const std::function<void(int, int)> &body);
+
+  /* Calls task(i) for i in [0, ntasks) in parallel and returns when all
+   * tasks are done. Each thread starts on its own chunk of the tasks and
+   * then steals tasks from the end of the other threads' chunks. Tasks must
+   * not issue loops on the pool themselves. */
+  void runTasks(int ntasks, const std::function<void(int)> &task);
+};
@@ -39,7 +39,7 @@ def comparefiles(refname, testname):
     """ comparefiles(refname, testname)
         compares the two files line by line
         ignoring last element in each line
-        ignoring lines that start with '#'
+        ignoring the thread binding lines, which depend on the machine
         Inputs:
             refname  - reference filename
             testname - filename to compare
@@ -53,23 +53,19 @@ def comparefiles(refname, testname):
 
     # count the different elements
     fail = 0
-    
+
+    # split lines into elements (space delimiter), without the thread binding
+    reflines = [string.split(line, ' ') for line in dropbinding(reffile)]
+    testlines = [string.split(line, ' ') for line in dropbinding(testfile)]
+
     # loop over all lines
-    for refline in reffile:
+    for i, refwords in enumerate(reflines):
 
         # read the line in the testfile
-        testline = testfile.readline()
-        if not testline: 
+        if i >= len(testlines):
             fail = 1
             break
-
-        # split lines into elements (space delimiter)
-        refwords = string.split(refline, ' ')
-        testwords = string.split(testline, ' ')
-        
-        # ignore lines that start with '#'
-        if refwords[0] == '#':
-            continue
+        testwords = testlines[i]
     
         # loop over all but the last elements
         for ref, test in zip(refwords[:-1], testwords[:-1]):
@@ -82,3 +78,26 @@ def comparefiles(refname, testname):
     testfile.close()
 
     return fail 
+
+
+def dropbinding(lines):
+    """ dropbinding(lines)
+        removes the thread binding block from the header of an output file
+        Inputs:
+            lines - lines of the file
+        Output:
+            list of the other lines
+    """
+
+    kept = []
+    inbinding = False
+    for line in lines:
+        if line.startswith('# Thread binding'):
+            inbinding = True
+            continue
+        if inbinding and line.startswith('#                rank '):
+            continue
+        inbinding = False
+        kept.append(line)
+
+    return kept
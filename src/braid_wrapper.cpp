@@ -22,31 +22,95 @@
 #include "braid_wrapper.hpp"
 
 /* ========================================================= */
-myBraidVector::myBraidVector(int nChannels, int nBatch) {
+/* Round a number of bytes up to the alignment of the message sections */
+static size_t alignMsg(size_t nbytes) {
+  return (nbytes + BRAID_MSG_ALIGN - 1) / BRAID_MSG_ALIGN * BRAID_MSG_ALIGN;
+}
+
+/* Copy n values, in chunks on the threads of a pool */
+static void copyState(ThreadPool *threads, int n, MyReal *src, MyReal *dst) {
+  threads->parallelFor(n, [&](int first, int last) {
+    memcpy(dst + first, src + first, (last - first) * sizeof(MyReal));
+  });
+}
+
+/* Tag of the states passed between the processors in the serial sweeps (the
+ * network's ghost layers use tags 0 and 1) */
+#define SERIAL_TAG 2
+
+/* Check the header of a received message */
+static void checkMsgHeader(BraidMsgHeader *header, int nchannels, int nbatch,
+                           SpatialCoarsening *spatial) {
+  if (header->version != BRAID_MSG_VERSION) {
+    printf("\n\n ERROR while unpacking a buffer: Message version %d, expected "
+           "%d!\n\n",
+           header->version, BRAID_MSG_VERSION);
+    exit(1);
+  }
+  /* States of the coarse levels may have a coarser resolution */
+  int width = header->nchannels;
+  if (spatial != NULL && spatial->getResolution(width) >= 0) width = nchannels;
+  if (width != nchannels || header->nbatch != nbatch) {
+    printf("\n\n ERROR while unpacking a buffer: State dimensions %dx%d, "
+           "expected %dx%d!\n\n",
+           header->nbatch, header->nchannels, nbatch, nchannels);
+    exit(1);
+  }
+}
+
+/* ========================================================= */
+myBraidVector::myBraidVector(int nChannels, int nBatch, ThreadPool *threads) {
   nchannels = nChannels;
   nbatch = nBatch;
 
+  data = NULL;
   state = NULL;
   layer = NULL;
-  sendflag = -1.0;
+  level = 0;
+  shm = NULL;
+  shmowner = -1;
+  shmslot = -1;
+
+  /* Allocate the state vector in one contiguous block, the examples are
+   * first touched by the threads that apply the layers to them */
+  data = threads->allocate(nbatch, nchannels);
+  setStatePointers();
+}
 
-  /* Allocate the state vector */
-  state = new MyReal *[nbatch];
-  for (int iex = 0; iex < nbatch; iex++) {
-    state[iex] = new MyReal[nchannels];
-    for (int ic = 0; ic < nchannels; ic++) {
-      state[iex][ic] = 0.0;
-    }
-  }
+myBraidVector::myBraidVector(int nChannels, int nBatch, ShmTransport *Shm,
+                             int owner, int slot) {
+  nchannels = nChannels;
+  nbatch = nBatch;
+
+  state = NULL;
+  layer = NULL;
+  level = 0;
+  shm = Shm;
+  shmowner = owner;
+  shmslot = slot;
+
+  /* Use the state in the slot */
+  data = shm->getSlotData(shmowner, shmslot);
+  setStatePointers();
 }
 
 myBraidVector::~myBraidVector() {
-  /* Deallocate the state vector */
-  for (int iex = 0; iex < nbatch; iex++) {
-    delete[] state[iex];
-  }
+  /* Deallocate the state vector or give the slot back to its owner */
   delete[] state;
+  if (shm != NULL) {
+    shm->releaseSlot(shmowner, shmslot);
+  } else {
+    ThreadPool::deallocate(data);
+  }
   state = NULL;
+  data = NULL;
+}
+
+void myBraidVector::setStatePointers() {
+  state = new MyReal *[nbatch];
+  for (int iex = 0; iex < nbatch; iex++) {
+    state[iex] = &(data[iex * nchannels]);
+  }
 }
 
 int myBraidVector::getnChannels() { return nchannels; }
@@ -57,11 +121,13 @@ MyReal *myBraidVector::getState(int exampleID) { return state[exampleID]; }
 
 MyReal **myBraidVector::getState() { return state; }
 
+MyReal *myBraidVector::getData() { return data; }
+
 Layer *myBraidVector::getLayer() { return layer; }
 void myBraidVector::setLayer(Layer *layerptr) { layer = layerptr; }
 
-MyReal myBraidVector::getSendflag() { return sendflag; }
-void myBraidVector::setSendflag(MyReal value) { sendflag = value; }
+int myBraidVector::getLevel() { return level; }
+void myBraidVector::setLevel(int Level) { level = Level; }
 
 /* ========================================================= */
 /* ========================================================= */
@@ -79,12 +145,20 @@ myBraidApp::myBraidApp(DataSet *Data, Network *Network, Config *config,
 
   /* Set braid options */
   core->SetMaxLevels(config->braid_maxlevels);
-  core->SetMinCoarse(config->braid_mincoarse);
+
+  /* Stop coarsening before the coarse levels get spread thinner than
+   * braid_mincoarseproc time steps per processor */
+  int nprocs;
+  MPI_Comm_size(comm, &nprocs);
+  core->SetMinCoarse(
+      std::max(config->braid_mincoarse, config->braid_mincoarseproc * nprocs));
+
   core->SetPrintLevel(config->braid_printlevel);
   core->SetCFactor(0, config->braid_cfactor0);
   core->SetCFactor(-1, config->braid_cfactor);
   core->SetAccessLevel(config->braid_accesslevel);
   core->SetMaxIter(config->braid_maxiter);
+  maxiter = config->braid_maxiter;
   core->SetSkip(config->braid_setskip);
   if (config->braid_fmg) {
     core->SetFMG();
@@ -92,17 +166,85 @@ myBraidApp::myBraidApp(DataSet *Data, Network *Network, Config *config,
   core->SetNRelax(-1, config->braid_nrelax);
   core->SetNRelax(0, config->braid_nrelax0);
   core->SetAbsTol(config->braid_abstol);
+
+  /* Message compression */
+  compress_type = config->braid_compress;
+  compress_factor = config->braid_compresstol;
+  rnorm = -1.0;
+
+  /* Shared memory slots for the message states (the network block isn't set
+   * up yet, take the width from the config). Messages go to higher ranks,
+   * which all need to be on this node. */
+  int size;
+  int statesize = config->nchannels * data->getnBatch() * sizeof(MyReal);
+  MPI_Comm_size(comm, &size);
+  shm = new ShmTransport(comm, config->braid_shmslots, statesize);
+  shmsend = shm->onNode(myid + 1, size - 1);
+
+  checkpoints = NULL;
+
+  /* Speculative F-relaxation on the fine grid */
+  ftasks = NULL;
+  if (config->braid_ftasks) {
+    ftasks = new FIntervalTasks(network, data->getnBatch(), config->nchannels,
+                                config->braid_cfactor0, config->nlayers - 2,
+                                config->T);
+  }
+
+  /* Coarser images on the coarse levels of convolutional networks. Braid
+   * then calls Coarsen and Refine between the levels. */
+  spatial = NULL;
+  if (config->braid_spatialcoarsen > 0 &&
+      config->network_type == CONVOLUTIONAL) {
+    spatial = new SpatialCoarsening(config->nchannels, config->nfeatures,
+                                    config->braid_spatialcoarsen);
+    core->SetSpatialCoarsenAndRefine();
+  }
+
+  /* Layers for the coarse levels */
+  coarseprop = new CoarsePropagator(network, config, spatial);
+  warmstart = config->braid_warmstart;
+
+  /* Sweeps over the layers instead of braid */
+  serial = (config->braid_serial == SERIAL_ON);
+  serialstate = NULL;
+  convfactors = 0.0;
+  nconvfactors = 0;
+  niter = 0;
+  niterations = 0;
+  nitercap = 0;
+  pointtime.assign(ntime + 1, 0.0);
 }
 
 myBraidApp::~myBraidApp() {
   /* Delete the core, if drive() has been called */
   if (core->GetWarmRestart()) delete core;
+
+  /* Free the slots after the vectors using them */
+  if (serialstate != NULL) delete serialstate;
+  delete shm;
+
+  if (ftasks != NULL) delete ftasks;
+  delete coarseprop;
+  delete spatial;
 }
 
 MyReal myBraidApp::getObjective() { return objective; }
 
 BraidCore *myBraidApp::getCore() { return core; }
 
+void myBraidApp::setTolerance(MyReal abstol, int Maxiter) {
+  maxiter = Maxiter;
+  core->SetAbsTol(abstol);
+  core->SetMaxIter(maxiter);
+}
+
+int myBraidApp::getnIter() { return niter; }
+
+void myBraidApp::setCheckpointStore(CheckpointStore *store) {
+  checkpoints = store;
+}
+
 void myBraidApp::GetGridDistribution(int *ilower_ptr, int *iupper_ptr) {
   core->GetDistribution(ilower_ptr, iupper_ptr);
 }
@@ -113,20 +255,369 @@ braid_Int myBraidApp::GetTimeStepIndex(MyReal t) {
   return ts;
 }
 
+void myBraidApp::LaunchFIntervalTasks(int ts, myBraidVector *u) {
+  int ilower, iupper;
+  braid_BaseVector ubase;
+  int size = data->getnBatch() * network->getnChannels();
+
+  GetGridDistribution(&ilower, &iupper);
+  if (ts != ftasks->getFirstCPoint(ilower)) return;
+
+  /* Get the current C-point values */
+  int nintervals = ftasks->getnIntervals(ilower, iupper);
+  if (nintervals == 0) return;
+  MyReal **cstates = new MyReal *[nintervals];
+  for (int i = 0; i < nintervals; i++) {
+    _braid_UGetVectorRef(core->GetCore(), 0, ts + i * ftasks->getCFactor(),
+                         &ubase);
+    cstates[i] = NULL;
+    if (ubase != NULL) {
+      cstates[i] = ((myBraidVector *)ubase->userVector)->getData();
+    }
+  }
+
+  /* Only if the step starts from the C-point value are the other C-points
+   * current as well */
+  if (cstates[0] != NULL &&
+      memcmp(cstates[0], u->getData(), size * sizeof(MyReal)) == 0) {
+    ftasks->launch(ilower, iupper, cstates);
+  }
+
+  delete[] cstates;
+}
+
+void myBraidApp::SetResidualNorm(BraidStepStatus &pstatus) {
+  int nreq = -1;
+  MyReal norm = -1.0;
+
+  /* Get the most recent residual norm. None is available in the first
+   * iteration. */
+  pstatus.GetRNorms(&nreq, &norm);
+  if (nreq > 0 && norm >= 0.0) rnorm = norm;
+}
+
+void myBraidApp::StepLocal(myBraidVector *u, int ts, int compute_gradient) {
+  int nbatch = data->getnBatch();
+  Layer *layer = network->getLayer(ts);
+
+  /* Same time step size as braid on the fine grid */
+  MyReal dt = ((ts + 1) / (MyReal)ntime) * (tstop - tstart) -
+              (ts / (MyReal)ntime) * (tstop - tstart);
+  layer->setDt(dt);
+  network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+    for (int iex = first; iex < last; iex++) {
+      layer->applyFWD(u->getState(iex));
+    }
+  });
+  layer->gatherTensorSlices(nbatch, u->getData());
+  u->setLayer(network->getLayer(ts + 1));
+}
+
+void myBraidApp::RunSerial() {
+  int ilower, iupper;
+  int nbatch = data->getnBatch();
+  int nchannels = network->getnChannels();
+  Layer *openlayer = network->getLayer(-1);
+
+  if (serialstate == NULL) {
+    serialstate =
+        new myBraidVector(nchannels, nbatch, network->getThreadPool());
+  }
+  myBraidVector *u = serialstate;
+
+  /* Start from the initial condition, or from the state passed on by the
+   * previous processor */
+  GetGridDistribution(&ilower, &iupper);
+  if (ilower == 0) {
+    MyReal opentime = MPI_Wtime();
+    network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+      for (int iex = first; iex < last; iex++) {
+        openlayer->setExample(data->getExample(iex));
+        openlayer->applyFWD(u->getState(iex));
+      }
+    });
+    CountPoint(0, MPI_Wtime() - opentime);
+  } else {
+    MPI_Recv(u->getData(), nbatch * nchannels, MPI_MyReal, myid - 1,
+             SERIAL_TAG, comm_t, MPI_STATUS_IGNORE);
+  }
+  u->setLayer(network->getLayer(ilower));
+
+  /* Step over the own layers, the last step leads to the next processor */
+  for (int ts = ilower; ts <= iupper; ts++) {
+    if (checkpoints != NULL) checkpoints->storeState(ts, u->getData());
+    if (ts == ntime) break;
+
+    MyReal steptime = MPI_Wtime();
+    StepLocal(u, ts, 0);
+    CountStep(0, ts, MPI_Wtime() - steptime);
+  }
+  if (iupper < ntime) {
+    MPI_Send(u->getData(), nbatch * nchannels, MPI_MyReal, myid + 1,
+             SERIAL_TAG, comm_t);
+  }
+}
+
+myBraidVector *myBraidApp::GetLastState() {
+  braid_BaseVector ubase;
+  int ilower, iupper;
+
+  if (serial) {
+    GetGridDistribution(&ilower, &iupper);
+    return iupper == ntime ? serialstate : NULL;
+  }
+
+  _braid_UGetLast(core->GetCore(), &ubase);
+  if (ubase == NULL) return NULL;
+  return (myBraidVector *)ubase->userVector;
+}
+
+void myBraidApp::SetInitialGuess() {
+  int ilower, iupper;
+  int nbatch = data->getnBatch();
+  braid_BaseVector ubase;
+  braid_Vector state = NULL;
+
+  /* Before the first run, braid sets up the grid with Init */
+  if (!core->GetWarmRestart() || warmstart == WARMSTART_GRID) return;
+
+  GetGridDistribution(&ilower, &iupper);
+  for (int ts = ilower; ts <= iupper; ts++) {
+    /* States stored on the fine grid (braid only keeps the C-points) */
+    _braid_UGetVectorRef(core->GetCore(), 0, ts, &ubase);
+    myBraidVector *u = NULL;
+    if (ubase != NULL) u = (myBraidVector *)ubase->userVector;
+
+    /* Zero, like a state from Init, except for the initial condition */
+    if (warmstart == WARMSTART_NONE) {
+      if (u == NULL || ts == 0) continue;
+      int n = nbatch * u->getnChannels();
+      MyReal *values = u->getData();
+      network->getThreadPool()->parallelFor(n, [&](int first, int last) {
+        memset(values + first, 0, (last - first) * sizeof(MyReal));
+      });
+      continue;
+    }
+
+    /* Sweep: start from the first stored state, replace the following ones
+     * by the propagated state */
+    if (u != NULL) {
+      if (state == NULL) {
+        Clone(ubase->userVector, &state);
+      } else {
+        copyState(network->getThreadPool(), nbatch * u->getnChannels(),
+                  ((myBraidVector *)state)->getData(), u->getData());
+      }
+    }
+    if (state != NULL && ts < iupper) StepLocal((myBraidVector *)state, ts, 0);
+  }
+  if (state != NULL) Free(state);
+}
+
+int myBraidApp::GetResolution(myBraidVector *u) {
+  if (spatial == NULL) return 0;
+  return spatial->getResolution(u->getnChannels());
+}
+
+int myBraidApp::GetLevelResolution(int level) {
+  if (spatial == NULL) return 0;
+  return std::min(level, spatial->getnResolutions() - 1);
+}
+
+void myBraidApp::CheckResolution(myBraidVector *u) {
+  int res = GetResolution(u);
+  if (res != GetLevelResolution(u->getLevel())) {
+    printf("\n\n ERROR: State of resolution %d on braid level %d, expected "
+           "resolution %d!\n\n",
+           res, u->getLevel(), GetLevelResolution(u->getLevel()));
+    exit(1);
+  }
+}
+
+void myBraidApp::CountStep(int level, int point, MyReal time) {
+  if (level >= (int)levelsteps.size()) {
+    levelsteps.resize(level + 1, 0);
+    leveltime.resize(level + 1, 0.0);
+  }
+  levelsteps[level]++;
+  leveltime[level] += time;
+  CountPoint(point, time);
+}
+
+void myBraidApp::CountPoint(int point, MyReal time) {
+  if (point >= 0 && point <= ntime) pointtime[point] += time;
+}
+
+std::vector<MyReal> &myBraidApp::getPointTimes() { return pointtime; }
+
+MyReal myBraidApp::getConvergenceFactor() {
+  if (nconvfactors == 0) return -1.0;
+  return convfactors / nconvfactors;
+}
+
+void myBraidApp::writeLevelStats(FILE *outfile, const char *name,
+                                 MPI_Comm comm) {
+  int rank, nlevels, maxlevels;
+
+  /* Levels that haven't been visited on this processor count zero steps */
+  MPI_Comm_rank(comm, &rank);
+  nlevels = levelsteps.size();
+  MPI_Allreduce(&nlevels, &maxlevels, 1, MPI_INT, MPI_MAX, comm);
+  levelsteps.resize(maxlevels, 0);
+  leveltime.resize(maxlevels, 0.0);
+
+  std::vector<int> nsteps(maxlevels);
+  std::vector<MyReal> maxtime(maxlevels);
+  std::vector<MyReal> sumtime(maxlevels);
+  MPI_Reduce(levelsteps.data(), nsteps.data(), maxlevels, MPI_INT, MPI_SUM, 0,
+             comm);
+  MPI_Reduce(leveltime.data(), maxtime.data(), maxlevels, MPI_MyReal, MPI_MAX,
+             0, comm);
+  MPI_Reduce(leveltime.data(), sumtime.data(), maxlevels, MPI_MyReal, MPI_SUM,
+             0, comm);
+
+  if (rank == 0 && serial) {
+    fprintf(outfile, " %s sweeps (without braid)\n", name);
+  } else if (rank == 0) {
+    if (nconvfactors > 0) {
+      fprintf(outfile, " %s braid: convergence factor %.4f\n", name,
+              getConvergenceFactor());
+    } else {
+      fprintf(outfile, " %s braid: convergence factor n/a\n", name);
+    }
+    fprintf(outfile, "   %d iterations, %d allowed by the caps\n",
+            niterations, nitercap);
+  }
+  if (rank == 0) {
+    for (int level = 0; level < maxlevels; level++) {
+      MyReal perstep = nsteps[level] > 0 ? sumtime[level] / nsteps[level] : 0;
+      fprintf(outfile,
+              "   level %d: %9d steps, %.4f seconds (max), %.3e per step\n",
+              level, nsteps[level], maxtime[level], perstep);
+    }
+  }
+}
+
+MyReal myBraidApp::GetCompressTol(myBraidVector *u) {
+  int nchannels = u->getnChannels();
+  int nbatch = data->getnBatch();
+
+  if (rnorm < 0.0) return 0.0;
+
+  /* An error of tol in each entry gives a spatial norm of
+   * tol * sqrt(nbatch * nchannels) / nbatch */
+  return compress_factor * rnorm * nbatch / sqrt(nbatch * nchannels);
+}
+
+int myBraidApp::GetCompressType(myBraidVector *u) {
+  int nbatch = data->getnBatch();
+
+  /* The fine grid states converge to the solution, keep them exact */
+  if (compress_type == COMPRESS_NONE || u->getLevel() == 0) {
+    return COMPRESS_NONE;
+  }
+
+  return compressType(compress_type, GetCompressTol(u),
+                      nbatch * u->getnChannels(), u->getData(),
+                      network->getThreadPool());
+}
+
+size_t myBraidApp::StateBufSize() {
+  int nchannels = network->getnChannels();
+  int nbatch = data->getnBatch();
+
+  /* States may also be sent uncompressed (see GetCompressType) */
+  size_t bound = std::max(compressBound(compress_type, nbatch * nchannels),
+                          compressBound(COMPRESS_NONE, nbatch * nchannels));
+  return alignMsg(bound);
+}
+
+void myBraidApp::PackState(myBraidVector *u, BraidMsgHeader *header,
+                           char *buffer) {
+  int nchannels = u->getnChannels();
+  int nbatch = data->getnBatch();
+  int slot = -1;
+
+  /* Try to pass the state in a shared memory slot */
+  if (shmsend) slot = shm->acquireSlot();
+  if (slot >= 0) {
+    copyState(network->getThreadPool(), nbatch * nchannels, u->getData(),
+              shm->getSlotData(myid, slot));
+    shm->publishSlot();
+
+    header->shmowner = myid;
+    header->shmslot = slot;
+    header->compress = COMPRESS_NONE;
+    header->nbytes = 0;
+    return;
+  }
+
+  /* Else copy it into the message */
+  header->shmowner = -1;
+  header->shmslot = -1;
+  header->compress = GetCompressType(u);
+  header->nbytes =
+      compressState(header->compress, GetCompressTol(u), nbatch * nchannels,
+                    u->getData(), buffer, network->getThreadPool());
+}
+
+myBraidVector *myBraidApp::UnpackState(BraidMsgHeader *header,
+                                       char *buffer) {
+  int nchannels = header->nchannels;
+  int nbatch = data->getnBatch();
+  myBraidVector *u;
+
+  if (header->shmslot >= 0) {
+    /* Take over the sender's slot */
+    shm->syncSlots();
+    u = new myBraidVector(nchannels, nbatch, shm, header->shmowner,
+                          header->shmslot);
+  } else {
+    u = new myBraidVector(nchannels, nbatch, network->getThreadPool());
+    decompressState(header->compress, nbatch * nchannels, buffer,
+                    u->getData(), network->getThreadPool());
+  }
+  u->setLevel(header->level);
+
+  return u;
+}
+
 braid_Int myBraidApp::Step(braid_Vector u_, braid_Vector ustop_,
                            braid_Vector fstop_, BraidStepStatus &pstatus) {
-  int ts_stop;
+  int ts_start, ts_stop;
+  int level;
+  int done = 0;
   MyReal tstart, tstop;
   MyReal deltaT;
+  MyReal steptime = MPI_Wtime();
 
   myBraidVector *u = (myBraidVector *)u_;
   int nbatch = data->getnBatch();
 
   /* Get the time-step size and current time index*/
   pstatus.GetTstartTstop(&tstart, &tstop);
+  ts_start = GetTimeStepIndex(tstart);
   ts_stop = GetTimeStepIndex(tstop);
   deltaT = tstop - tstart;
 
+  /* Keep track of the residual for the message compression */
+  SetResidualNorm(pstatus);
+
+  /* The layer of u may be a ghost layer that is still being received */
+  network->waitForLayer(u->getLayer()->getIndex());
+
+  /* On the fine grid, take the step from the F-interval tasks if possible */
+  pstatus.GetLevel(&level);
+  u->setLevel(level);
+  if (ftasks != NULL && level == 0) {
+    if (!ftasks->apply(ts_start, u->getLayer(), deltaT, u->getData())) {
+      LaunchFIntervalTasks(ts_start, u);
+      done = ftasks->apply(ts_start, u->getLayer(), deltaT, u->getData());
+    } else {
+      done = 1;
+    }
+  }
+
   /* Set time step size */
   u->getLayer()->setDt(deltaT);
 
@@ -134,19 +625,26 @@ braid_Int myBraidApp::Step(braid_Vector u_, braid_Vector ustop_,
   // app->myid, tstart, ts_stop, tstop, u->layer->getIndex(),
   // u->layer->getWeights()[3], u->state[1][1], u->layer->getnDesign());
 
-  /* apply the layer for all examples */
-  for (int iex = 0; iex < nbatch; iex++) {
-    /* Apply the layer */
-    u->getLayer()->applyFWD(u->getState(iex));
+  /* On the coarse levels, the step may apply a coarse layer instead */
+  Layer *layer = u->getLayer();
+  if (level > 0) {
+    Layer *coarse = coarseprop->getLayer(ts_start, ts_stop, GetResolution(u));
+    if (coarse != NULL) layer = coarse;
+    layer->setDt(deltaT);
   }
 
-  /* Free the layer, if it has just been send to this processor */
-  if (u->getSendflag() > 0.0) {
-    delete[] u->getLayer()->getWeights();
-    delete[] u->getLayer()->getWeightsBar();
-    delete u->getLayer();
+  /* apply the layer for all examples */
+  if (!done) {
+    network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+      for (int iex = first; iex < last; iex++) {
+        /* Apply the layer */
+        layer->applyFWD(u->getState(iex));
+      }
+    });
+
+    /* Exchange the outputs with the processors sharing the layer */
+    layer->gatherTensorSlices(nbatch, u->getData());
   }
-  u->setSendflag(-1.0);
 
   /* Move the layer pointer of u forward to that of tstop */
   u->setLayer(network->getLayer(ts_stop));
@@ -154,6 +652,73 @@ braid_Int myBraidApp::Step(braid_Vector u_, braid_Vector ustop_,
   /* no refinement */
   pstatus.SetRFactor(1);
 
+  CountStep(level, ts_start, MPI_Wtime() - steptime);
+
+  return 0;
+}
+
+braid_Int myBraidApp::Coarsen(braid_Vector fu_, braid_Vector *cu_ptr,
+                              BraidCoarsenRefStatus &status) {
+  myBraidVector *fu = (myBraidVector *)fu_;
+  int nbatch = fu->getnBatch();
+  int res = GetResolution(fu);
+
+  /* Resolution of the level above, taken from the level of the state */
+  CheckResolution(fu);
+  int cres = GetLevelResolution(fu->getLevel() + 1);
+
+  /* Keep the resolution of the coarsest images */
+  if (cres == res) {
+    Clone(fu_, cu_ptr);
+    ((myBraidVector *)*cu_ptr)->setLevel(fu->getLevel() + 1);
+    return 0;
+  }
+
+  myBraidVector *cu = new myBraidVector(spatial->getnChannels(cres), nbatch,
+                                        network->getThreadPool());
+  network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+    for (int iex = first; iex < last; iex++) {
+      spatial->restrict(res, fu->getState(iex), cu->getState(iex));
+    }
+  });
+  cu->setLayer(fu->getLayer());
+  cu->setLevel(fu->getLevel() + 1);
+
+  *cu_ptr = (braid_Vector)cu;
+  return 0;
+}
+
+braid_Int myBraidApp::Refine(braid_Vector cu_, braid_Vector *fu_ptr,
+                             BraidCoarsenRefStatus &status) {
+  myBraidVector *cu = (myBraidVector *)cu_;
+  int nbatch = cu->getnBatch();
+  int cres = GetResolution(cu);
+
+  /* Resolution of the level below, taken from the level of the state (not
+   * from the status, whose level depends on how braid numbers them) */
+  CheckResolution(cu);
+  if (cu->getLevel() == 0) {
+    printf("\n\n ERROR: Refine called on a state of the fine grid!\n\n");
+    exit(1);
+  }
+  int res = GetLevelResolution(cu->getLevel() - 1);
+  if (res == cres) {
+    Clone(cu_, fu_ptr);
+    ((myBraidVector *)*fu_ptr)->setLevel(cu->getLevel() - 1);
+    return 0;
+  }
+
+  myBraidVector *fu = new myBraidVector(spatial->getnChannels(res), nbatch,
+                                        network->getThreadPool());
+  network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+    for (int iex = first; iex < last; iex++) {
+      spatial->interpolate(res, cu->getState(iex), fu->getState(iex));
+    }
+  });
+  fu->setLayer(cu->getLayer());
+  fu->setLevel(cu->getLevel() - 1);
+
+  *fu_ptr = (braid_Vector)fu;
   return 0;
 }
 
@@ -172,16 +737,14 @@ braid_Int myBraidApp::Clone(braid_Vector u_, braid_Vector *v_ptr) {
   int nbatch = u->getnBatch();
 
   /* Allocate a new vector */
-  myBraidVector *v = new myBraidVector(nchannels, nbatch);
+  myBraidVector *v =
+      new myBraidVector(nchannels, nbatch, network->getThreadPool());
 
   /* Copy the values */
-  for (int iex = 0; iex < nbatch; iex++) {
-    for (int ic = 0; ic < nchannels; ic++) {
-      v->getState(iex)[ic] = u->getState(iex)[ic];
-    }
-  }
+  copyState(network->getThreadPool(), nbatch * nchannels, u->getData(),
+            v->getData());
   v->setLayer(u->getLayer());
-  v->setSendflag(u->getSendflag());
+  v->setLevel(u->getLevel());
 
   /* Set the return pointer */
   *v_ptr = (braid_Vector)v;
@@ -193,21 +756,26 @@ braid_Int myBraidApp::Init(braid_Real t, braid_Vector *u_ptr) {
   int nchannels = network->getnChannels();
   int nbatch = data->getnBatch();
 
-  myBraidVector *u = new myBraidVector(nchannels, nbatch);
+  myBraidVector *u =
+      new myBraidVector(nchannels, nbatch, network->getThreadPool());
 
   /* Apply the opening layer */
   if (t == 0) {
     Layer *openlayer = network->getLayer(-1);
+    MyReal opentime = MPI_Wtime();
     // printf("%d: Init %f: layer %d using %1.14e state %1.14e, %d\n",
     // app->myid, t, openlayer->getIndex(), openlayer->getWeights()[3],
     // u->state[1][1], openlayer->getnDesign());
-    for (int iex = 0; iex < nbatch; iex++) {
-      /* set example */
-      openlayer->setExample(data->getExample(iex));
+    network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+      for (int iex = first; iex < last; iex++) {
+        /* set example */
+        openlayer->setExample(data->getExample(iex));
 
-      /* Apply the layer */
-      openlayer->applyFWD(u->getState(iex));
-    }
+        /* Apply the layer */
+        openlayer->applyFWD(u->getState(iex));
+      }
+    });
+    CountPoint(0, MPI_Wtime() - opentime);
   }
 
   /* Set the layer pointer */
@@ -234,206 +802,130 @@ braid_Int myBraidApp::Sum(braid_Real alpha, braid_Vector x_, braid_Real beta,
   myBraidVector *x = (myBraidVector *)x_;
   myBraidVector *y = (myBraidVector *)y_;
 
-  int nchannels = network->getnChannels();
+  int nchannels = y->getnChannels();
   int nbatch = data->getnBatch();
-
-  for (int iex = 0; iex < nbatch; iex++) {
-    for (int ic = 0; ic < nchannels; ic++) {
-      y->getState(iex)[ic] =
-          alpha * (x->getState(iex)[ic]) + beta * (y->getState(iex)[ic]);
+  MyReal *xdata = x->getData();
+  MyReal *ydata = y->getData();
+
+  /* Contiguous loop over all examples and channels */
+  int n = nbatch * nchannels;
+  network->getThreadPool()->parallelFor(n, [&](int first, int last) {
+    for (int i = first; i < last; i++) {
+      ydata[i] = alpha * xdata[i] + beta * ydata[i];
     }
-  }
+  });
 
   return 0;
 }
 
 braid_Int myBraidApp::SpatialNorm(braid_Vector u_, braid_Real *norm_ptr) {
   myBraidVector *u = (myBraidVector *)u_;
-  int nchannels = network->getnChannels();
+  int nchannels = u->getnChannels();
   int nbatch = data->getnBatch();
 
+  /* Compute the dot products of the examples in parallel and sum them up in
+   * the order of the examples. The norm is then the same for any number of
+   * threads. */
+  MyReal *dots = new MyReal[nbatch];
+  network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+    for (int iex = first; iex < last; iex++) {
+      dots[iex] = vecdot(nchannels, u->getState(iex), u->getState(iex));
+    }
+  });
   MyReal dot = 0.0;
   for (int iex = 0; iex < nbatch; iex++) {
-    dot += vecdot(nchannels, u->getState(iex), u->getState(iex));
+    dot += dots[iex];
   }
+  delete[] dots;
   *norm_ptr = sqrt(dot) / nbatch;
 
   return 0;
 }
 
 braid_Int myBraidApp::Access(braid_Vector u_, BraidAccessStatus &astatus) {
-  printf("my_Access: To be implemented...\n");
+  myBraidVector *u = (myBraidVector *)u_;
+  int ts, level;
+
+  if (checkpoints == NULL) {
+    printf("my_Access: To be implemented...\n");
+    return 0;
+  }
+
+  /* Keep the fine grid checkpoints (the last call wins) */
+  astatus.GetTIndex(&ts);
+  astatus.GetLevel(&level);
+  if (level == 0) checkpoints->storeState(ts, u->getData());
 
   return 0;
 }
 
 braid_Int myBraidApp::BufSize(braid_Int *size_ptr, BraidBufferStatus &bstatus) {
-  int nchannels = network->getnChannels();
-  int nbatch = data->getnBatch();
-
-  /* Gather number of variables */
-  int nuvector = nchannels * nbatch;
-  int nlayerinfo = 12;
-  int nlayerdesign = network->getnDesignLayermax();
-
-  /* Set the size */
-  *size_ptr = (nuvector + nlayerinfo + nlayerdesign) * sizeof(MyReal);
+  /* Set the size: header and state section */
+  *size_ptr = alignMsg(sizeof(BraidMsgHeader)) + StateBufSize();
 
   return 0;
 }
 
 braid_Int myBraidApp::BufPack(braid_Vector u_, void *buffer,
                               BraidBufferStatus &bstatus) {
-  int size;
-  int nchannels = network->getnChannels();
   int nbatch = data->getnBatch();
-  MyReal *dbuffer = (MyReal *)buffer;
+  char *cbuffer = (char *)buffer;
   myBraidVector *u = (myBraidVector *)u_;
-
-  /* Store network state */
-  int idx = 0;
-  for (int iex = 0; iex < nbatch; iex++) {
-    for (int ic = 0; ic < nchannels; ic++) {
-      dbuffer[idx] = u->getState(iex)[ic];
-      idx++;
-    }
-  }
-  size = nchannels * nbatch * sizeof(MyReal);
-
-  int nweights = u->getLayer()->getnWeights();
-  int nbias = u->getLayer()->getDimBias();
-
-  dbuffer[idx] = u->getLayer()->getType();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getIndex();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getDimIn();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getDimOut();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getDimBias();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getnWeights();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getActivation();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getnDesign();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getGammaTik();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getGammaDDT();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getnConv();
-  idx++;
-  dbuffer[idx] = u->getLayer()->getCSize();
-  idx++;
-  for (int i = 0; i < nweights; i++) {
-    dbuffer[idx] = u->getLayer()->getWeights()[i];
-    idx++;
-    // dbuffer[idx] = u->layer->getWeightsBar()[i];  idx++;
-  }
-  for (int i = 0; i < nbias; i++) {
-    dbuffer[idx] = u->getLayer()->getBias()[i];
-    idx++;
-    // dbuffer[idx] = u->layer->getBiasBar()[i];  idx++;
-  }
-  size += (12 + (nweights + nbias)) * sizeof(MyReal);
-
-  bstatus.SetSize(size);
+  int nchannels = u->getnChannels();
+  Layer *layer = u->getLayer();
+
+  /* Set up the header, refer to the layer by index and design version */
+  BraidMsgHeader header;
+  memset(&header, 0, sizeof(BraidMsgHeader));
+  header.version = BRAID_MSG_VERSION;
+  header.nbatch = nbatch;
+  header.nchannels = nchannels;
+  header.level = u->getLevel();
+  header.haslayer = 1;
+  header.index = layer->getIndex();
+  header.designversion = network->getDesignVersion();
+  header.layertype = layer->getType();
+  header.ndesign = layer->getnDesign();
+
+  /* Pack network state and header */
+  size_t offset = alignMsg(sizeof(BraidMsgHeader));
+  PackState(u, &header, cbuffer + offset);
+  offset += header.nbytes;
+  memcpy(cbuffer, &header, sizeof(BraidMsgHeader));
+
+  bstatus.SetSize(offset);
 
   return 0;
 }
 
 braid_Int myBraidApp::BufUnpack(void *buffer, braid_Vector *u_ptr,
                                 BraidBufferStatus &bstatus) {
-  Layer *tmplayer = 0;
-  MyReal *dbuffer = (MyReal *)buffer;
+  char *cbuffer = (char *)buffer;
 
   int nchannels = network->getnChannels();
   int nbatch = data->getnBatch();
 
-  /* Allocate a new vector */
-  myBraidVector *u = new myBraidVector(nchannels, nbatch);
-
-  /* Unpack the buffer */
-  int idx = 0;
-  for (int iex = 0; iex < nbatch; iex++) {
-    for (int ic = 0; ic < nchannels; ic++) {
-      u->getState(iex)[ic] = dbuffer[idx];
-      idx++;
-    }
+  /* Read and check the header */
+  BraidMsgHeader header;
+  size_t offset = 0;
+  memcpy(&header, cbuffer + offset, sizeof(BraidMsgHeader));
+  offset += alignMsg(sizeof(BraidMsgHeader));
+  checkMsgHeader(&header, nchannels, nbatch, spatial);
+
+  /* Unpack the state */
+  myBraidVector *u = UnpackState(&header, cbuffer + offset);
+
+  /* Get the layer from the network (fetches its design at most once per
+   * design update) */
+  Layer *layer = network->getRemoteLayer(header.index, header.designversion);
+  if (layer->getType() != header.layertype ||
+      layer->getnDesign() != header.ndesign) {
+    printf("\n\n ERROR while unpacking a buffer: Layer %d doesn't match the "
+           "sender's layer!\n\n",
+           header.index);
+    exit(1);
   }
-
-  /* Receive and initialize a layer. Set the sendflag */
-  int layertype = dbuffer[idx];
-  idx++;
-  int index = dbuffer[idx];
-  idx++;
-  int dimIn = dbuffer[idx];
-  idx++;
-  int dimOut = dbuffer[idx];
-  idx++;
-  int dimBias = dbuffer[idx];
-  idx++;
-  int nweights = dbuffer[idx];
-  idx++;
-  int activ = dbuffer[idx];
-  idx++;
-  int nDesign = dbuffer[idx];
-  idx++;
-  int gammatik = dbuffer[idx];
-  idx++;
-  int gammaddt = dbuffer[idx];
-  idx++;
-  int nconv = dbuffer[idx];
-  idx++;
-  int csize = dbuffer[idx];
-  idx++;
-
-  /* layertype decides on which layer should be created */
-  switch (layertype) {
-    case Layer::OPENZERO:
-      tmplayer = new OpenExpandZero(dimIn, dimOut);
-      break;
-    case Layer::OPENDENSE:
-      tmplayer = new OpenDenseLayer(dimIn, dimOut, activ, gammatik);
-      break;
-    case Layer::DENSE:
-      tmplayer =
-          new DenseLayer(index, dimIn, dimOut, 1.0, activ, gammatik, gammaddt);
-      break;
-    case Layer::CLASSIFICATION:
-      tmplayer = new ClassificationLayer(index, dimIn, dimOut, gammatik);
-      break;
-    case Layer::OPENCONV:
-      tmplayer = new OpenConvLayer(dimIn, dimOut);
-      break;
-    case Layer::OPENCONVMNIST:
-      tmplayer = new OpenConvLayerMNIST(dimIn, dimOut);
-      break;
-    case Layer::CONVOLUTION:
-      tmplayer = new ConvLayer(index, dimIn, dimOut, csize, nconv, 1.0, activ,
-                               gammatik, gammaddt);
-      break;
-    default:
-      printf("\n\n ERROR while unpacking a buffer: Layertype unknown!!\n\n");
-  }
-
-  /* Allocate design and gradient */
-  MyReal *design = new MyReal[nDesign];
-  MyReal *gradient = new MyReal[nDesign];
-  tmplayer->setMemory(design, gradient);
-  /* Set the weights */
-  for (int i = 0; i < nweights; i++) {
-    tmplayer->getWeights()[i] = dbuffer[idx];
-    idx++;
-  }
-  for (int i = 0; i < dimBias; i++) {
-    tmplayer->getBias()[i] = dbuffer[idx];
-    idx++;
-  }
-  u->setLayer(tmplayer);
-  u->setSendflag(1.0);
+  u->setLayer(layer);
 
   /* Return the pointer */
   *u_ptr = (braid_Vector)u;
@@ -458,13 +950,17 @@ braid_Int myBraidApp::SetInitialCondition() {
       u = (myBraidVector *)ubase->userVector;
 
       /* Apply opening layer */
-      for (int iex = 0; iex < nbatch; iex++) {
-        /* set example */
-        openlayer->setExample(data->getExample(iex));
-
-        /* Apply the layer */
-        openlayer->applyFWD(u->getState(iex));
-      }
+      MyReal opentime = MPI_Wtime();
+      network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+        for (int iex = first; iex < last; iex++) {
+          /* set example */
+          openlayer->setExample(data->getExample(iex));
+
+          /* Apply the layer */
+          openlayer->applyFWD(u->getState(iex));
+        }
+      });
+      CountPoint(0, MPI_Wtime() - opentime);
     }
   }
 
@@ -472,7 +968,6 @@ braid_Int myBraidApp::SetInitialCondition() {
 }
 
 braid_Int myBraidApp::EvaluateObjective() {
-  braid_BaseVector ubase;
   myBraidVector *u;
   Layer *layer;
   MyReal myobjective;
@@ -500,9 +995,10 @@ braid_Int myBraidApp::EvaluateObjective() {
 
     /* At last layer: Classification and Loss evaluation */
     if (ilayer == network->getnLayersGlobal() - 2) {
-      _braid_UGetLast(core->GetCore(), &ubase);
-      u = (myBraidVector *)ubase->userVector;
+      MyReal classtime = MPI_Wtime();
+      u = GetLastState();
       network->evalClassification(data, u->getState(), 0);
+      CountPoint(ntime, MPI_Wtime() - classtime);
     }
     // printf("%d: layerid %d using %1.14e, tik %1.14e, ddt %1.14e, loss
     // %1.14e\n", app->myid, layer->getIndex(), layer->getWeights()[0],
@@ -512,20 +1008,49 @@ braid_Int myBraidApp::EvaluateObjective() {
   /* Collect objective function from all processors */
   myobjective = network->getLoss() + regul;
   objective = 0.0;
-  MPI_Allreduce(&myobjective, &objective, 1, MPI_MyReal, MPI_SUM,
-                MPI_COMM_WORLD);
+  MPI_Allreduce(&myobjective, &objective, 1, MPI_MyReal, MPI_SUM, comm_t);
+
+  /* Average over the data parallel replicas */
+  objective = data->reduceReplicas(objective);
 
   return 0;
 }
 
 MyReal myBraidApp::run() {
-  int nreq = -1;
+  int nreq;
   MyReal norm;
 
+  /* No residual norm from a previous run for the message compression */
+  rnorm = -1.0;
+
+  /* The sweeps solve exactly, but have no residual norm (like braid on
+   * one level) */
+  if (serial) {
+    RunSerial();
+    EvaluateObjective();
+    return -1.0;
+  }
+
   SetInitialCondition();
+  SetInitialGuess();
   core->Drive();
   EvaluateObjective();
-  core->GetRNorms(&nreq, &norm);
+
+  /* Residual norms of all iterations */
+  core->GetNumIter(&niter);
+  niterations += niter;
+  nitercap += maxiter;
+  nreq = niter + 1;
+  MyReal *norms = new MyReal[nreq];
+  core->GetRNorms(&nreq, norms);
+  norm = norms[nreq - 1];
+
+  /* Mean reduction of the residual per iteration */
+  if (nreq > 1 && norms[0] > 0.0 && norm >= 0.0) {
+    convfactors += pow(norm / norms[0], 1.0 / (nreq - 1));
+    nconvfactors++;
+  }
+  delete[] norms;
 
   return norm;
 }
@@ -534,42 +1059,234 @@ MyReal myBraidApp::run() {
 /* ========================================================= */
 /* ========================================================= */
 myAdjointBraidApp::myAdjointBraidApp(DataSet *Data, Network *Network,
-                                     Config *config, BraidCore *Primalcoreptr,
+                                     Config *config, myBraidApp *Primalapp,
                                      MPI_Comm comm)
     : myBraidApp(Data, Network, config, comm) {
-  primalcore = Primalcoreptr;
+  primalapp = Primalapp;
+  primalcore = Primalapp->getCore();
+  primalstore = NULL;
+  gradexchange = new GradientExchange(data, network, config);
+
+  /* Scratch states for the primal states on the coarse resolutions */
+  coarseprimal[0] = NULL;
+  coarseprimal[1] = NULL;
+  if (spatial != NULL) {
+    for (int i = 0; i < 2; i++) {
+      coarseprimal[i] = network->getThreadPool()->allocate(
+          data->getnBatch(), spatial->getnChannels(1));
+    }
+  }
 
-  /* Store all primal points */
-  primalcore->SetStorage(0);
+  if (serial) {
+    /* The primal sweeps store the states (or their checkpoints) */
+    int ilower, iupper;
+    Primalapp->GetGridDistribution(&ilower, &iupper);
+    primalstore =
+        new CheckpointStore(network, config, data->getnBatch(), ilower, iupper);
+    Primalapp->setCheckpointStore(primalstore);
+  } else if (config->braid_checkpoint > 0 ||
+             config->braid_primalstore != COMPRESS_NONE ||
+             strcmp(config->braid_spilldir, "NONE") != 0) {
+    /* Keep only checkpoints of the primal states (in reduced precision or in
+     * a scratch file), which are copied in the primal's access function at
+     * the end of its braid run */
+    int ilower, iupper;
+    Primalapp->GetGridDistribution(&ilower, &iupper);
+    primalstore =
+        new CheckpointStore(network, config, data->getnBatch(), ilower, iupper);
+    Primalapp->setCheckpointStore(primalstore);
+    if (config->braid_accesslevel < 1) primalcore->SetAccessLevel(1);
+  } else {
+    /* Store all primal points */
+    primalcore->SetStorage(0);
+  }
+
+  /* Tolerance of the adjoint solves */
+  setTolerance(config->braid_abstoladj, config->braid_maxiteradj);
 
   /* Revert processor ranks for solving adjoint with xbraid */
   core->SetRevertedRanks(1);
+
+  /* Messages go to lower ranks now */
+  shmsend = shm->onNode(0, myid - 1);
 }
 
-myAdjointBraidApp::~myAdjointBraidApp() {}
+myAdjointBraidApp::~myAdjointBraidApp() {
+  delete primalstore;
+  delete gradexchange;
+  for (int i = 0; i < 2; i++) {
+    if (coarseprimal[i] != NULL) ThreadPool::deallocate(coarseprimal[i]);
+  }
+}
+
+GradientExchange *myAdjointBraidApp::getGradientExchange() {
+  return gradexchange;
+}
 
 int myAdjointBraidApp::GetPrimalIndex(int ts) {
   int idx = network->getnLayersGlobal() - 2 - ts;
   return idx;
 }
 
+MyReal *myAdjointBraidApp::GetPrimalState(int primaltimestep,
+                                          Layer **layer_ptr) {
+  braid_BaseVector ubaseprimal;
+  myBraidVector *uprimal;
+  int finegrid = 0;
+
+  /* Get the state from the checkpoints (recomputes it, if needed) */
+  if (primalstore != NULL) {
+    *layer_ptr = network->getLayer(primaltimestep);
+    return primalstore->getState(primaltimestep);
+  }
+
+  /* Get the primal vector from the primal core */
+  _braid_UGetVectorRef(primalcore->GetCore(), finegrid, primaltimestep,
+                       &ubaseprimal);
+  uprimal = (myBraidVector *)ubaseprimal->userVector;
+  *layer_ptr = uprimal->getLayer();
+  return uprimal->getData();
+}
+
+MyReal *myAdjointBraidApp::RestrictPrimalState(MyReal *primalstate,
+                                               int res) {
+  int nbatch = data->getnBatch();
+  MyReal *fine = primalstate;
+
+  /* Halve the images res times, alternating between the scratch states */
+  for (int r = 0; r < res; r++) {
+    MyReal *coarse = coarseprimal[r % 2];
+    int nfine = spatial->getnChannels(r);
+    int ncoarse = spatial->getnChannels(r + 1);
+    network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+      for (int iex = first; iex < last; iex++) {
+        spatial->restrict(r, &(fine[iex * nfine]), &(coarse[iex * ncoarse]));
+      }
+    });
+    fine = coarse;
+  }
+
+  return fine;
+}
+
+void myAdjointBraidApp::RunSerial() {
+  int ilower, iupper;
+  int nbatch = data->getnBatch();
+  int nchannels = network->getnChannels();
+
+  if (serialstate == NULL) {
+    serialstate =
+        new myBraidVector(nchannels, nbatch, network->getThreadPool());
+  }
+  myBraidVector *u = serialstate;
+
+  /* Start from the terminal condition (derivative of the classification), or
+   * from the state passed on by the next processor. Its last step leads to
+   * this processor's first time step. */
+  GetGridDistribution(&ilower, &iupper);
+  if (ilower == 0) {
+    MyReal classtime = MPI_Wtime();
+    myBraidVector *uprimal = primalapp->GetLastState();
+    memset(u->getData(), 0, nbatch * nchannels * sizeof(MyReal));
+    uprimal->getLayer()->resetBar();
+    network->evalClassification_diff(data, uprimal->getState(), u->getState(),
+                                     1);
+    uprimal->getLayer()->evalTikh_diff(1.0);
+    CountPoint(ntime, MPI_Wtime() - classtime);
+  } else {
+    MPI_Recv(u->getData(), nbatch * nchannels, MPI_MyReal, myid + 1,
+             SERIAL_TAG, comm_t, MPI_STATUS_IGNORE);
+    MyReal steptime = MPI_Wtime();
+    StepLocal(u, ilower - 1, 1);
+    CountStep(0, GetPrimalIndex(ilower - 1), MPI_Wtime() - steptime);
+  }
+
+  /* Step backwards over the own layers, updating the gradient */
+  for (int ts = ilower; ts < iupper; ts++) {
+    MyReal steptime = MPI_Wtime();
+    StepLocal(u, ts, 1);
+    CountStep(0, GetPrimalIndex(ts), MPI_Wtime() - steptime);
+  }
+  if (iupper < ntime) {
+    MPI_Send(u->getData(), nbatch * nchannels, MPI_MyReal, myid - 1,
+             SERIAL_TAG, comm_t);
+  }
+}
+
+void myAdjointBraidApp::StepLocal(myBraidVector *u, int ts,
+                                  int compute_gradient) {
+  Layer *primallayer;
+  int primaltimestep = GetPrimalIndex(ts + 1);
+
+  /* Same time step size as braid on the fine grid */
+  MyReal dt = ((ts + 1) / (MyReal)ntime) * (tstop - tstart) -
+              (ts / (MyReal)ntime) * (tstop - tstart);
+  MyReal *primalstate = GetPrimalState(primaltimestep, &primallayer);
+  ApplyAdjointStep(primallayer, primalstate, u, primaltimestep, dt,
+                   compute_gradient);
+}
+
+void myAdjointBraidApp::ApplyAdjointStep(Layer *primallayer,
+                                         MyReal *primalstate, myBraidVector *u,
+                                         int primaltimestep, MyReal deltaT,
+                                         int compute_gradient) {
+  int nbatch = data->getnBatch();
+  int nchannels = u->getnChannels();
+
+  /* Reset gradient before the update */
+  if (compute_gradient) primallayer->resetBar();
+
+  /* Take one step backwards */
+  primallayer->setDt(deltaT);
+  network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+    for (int iex = first; iex < last; iex++) {
+      primallayer->applyBWD(&(primalstate[iex * nchannels]), u->getState(iex),
+                            compute_gradient);
+    }
+  });
+
+  /* Collect the gradient of the threads (in a fixed order) */
+  if (compute_gradient) primallayer->reduceBar();
+
+  /* Sum the partial adjoints and gradients of the processors sharing the
+   * layer */
+  primallayer->sumTensorSlices(nbatch, u->getData());
+  if (compute_gradient) primallayer->reduceTensorGradient();
+
+  // printf("%d: level %d step_adj %d->%d using layer %d,%1.14e, primal %1.14e,
+  // adj %1.14e, grad[0] %1.14e, %d\n", app->myid, level, ts_stop,
+  // uprimal->layer->getIndex(), uprimal->layer->getWeights()[3],
+  // uprimal->state[1][1], u->state[1][1], uprimal->layer->getWeightsBar()[0],
+  // uprimal->layer->getnDesign());
+
+  /* Derivative of DDT-Regularization */
+  if (compute_gradient) {
+    Layer *prev = network->getLayer(primaltimestep - 1);
+    Layer *next = network->getLayer(primaltimestep + 1);
+    primallayer->evalRegulDDT_diff(prev, next, network->getDT());
+  }
+
+  /* Derivative of tikhonov */
+  if (compute_gradient) primallayer->evalTikh_diff(1.0);
+}
+
 braid_Int myAdjointBraidApp::Step(braid_Vector u_, braid_Vector ustop_,
                                   braid_Vector fstop_,
                                   BraidStepStatus &pstatus) {
-  int ts_stop;
+  int ts_start, ts_stop;
   int level, compute_gradient;
   MyReal tstart, tstop;
   MyReal deltaT;
-  int finegrid = 0;
   int primaltimestep;
-  braid_BaseVector ubaseprimal;
-  myBraidVector *uprimal;
+  MyReal *primalstate;
+  Layer *primallayer;
+  MyReal steptime = MPI_Wtime();
 
-  int nbatch = data->getnBatch();
   myBraidVector *u = (myBraidVector *)u_;
 
   /* Update gradient only on the finest grid */
   pstatus.GetLevel(&level);
+  u->setLevel(level);
   if (level == 0)
     compute_gradient = 1;
   else
@@ -577,44 +1294,38 @@ braid_Int myAdjointBraidApp::Step(braid_Vector u_, braid_Vector ustop_,
 
   /* Get the time-step size and current time index*/
   pstatus.GetTstartTstop(&tstart, &tstop);
+  ts_start = GetTimeStepIndex(tstart);
   ts_stop = GetTimeStepIndex(tstop);
   deltaT = tstop - tstart;
   primaltimestep = GetPrimalIndex(ts_stop);
 
-  /* Get the primal vector from the primal core */
-  _braid_UGetVectorRef(primalcore->GetCore(), finegrid, primaltimestep,
-                       &ubaseprimal);
-  uprimal = (myBraidVector *)ubaseprimal->userVector;
+  /* Keep track of the residual for the message compression */
+  SetResidualNorm(pstatus);
 
-  /* Reset gradient before the update */
-  if (compute_gradient) uprimal->getLayer()->resetBar();
+  /* Get the primal state and layer */
+  primalstate = GetPrimalState(primaltimestep, &primallayer);
 
-  /* Take one step backwards, updates adjoint state and gradient, if desired. */
-  uprimal->getLayer()->setDt(deltaT);
-  for (int iex = 0; iex < nbatch; iex++) {
-    uprimal->getLayer()->applyBWD(uprimal->getState(iex), u->getState(iex),
-                                  compute_gradient);
+  /* On the coarse levels, the step may apply a coarse layer for the primal
+   * steps primaltimestep .. GetPrimalIndex(ts_start)-1 instead */
+  int res = GetResolution(u);
+  if (level > 0) {
+    Layer *coarse =
+        coarseprop->getLayer(primaltimestep, GetPrimalIndex(ts_start), res);
+    if (coarse != NULL) primallayer = coarse;
   }
 
-  // printf("%d: level %d step_adj %d->%d using layer %d,%1.14e, primal %1.14e,
-  // adj %1.14e, grad[0] %1.14e, %d\n", app->myid, level, ts_stop,
-  // uprimal->layer->getIndex(), uprimal->layer->getWeights()[3],
-  // uprimal->state[1][1], u->state[1][1], uprimal->layer->getWeightsBar()[0],
-  // uprimal->layer->getnDesign());
+  /* On the coarse resolutions, linearize about the restricted primal state */
+  if (res > 0) primalstate = RestrictPrimalState(primalstate, res);
 
-  /* Derivative of DDT-Regularization */
-  if (compute_gradient) {
-    Layer *prev = network->getLayer(primaltimestep - 1);
-    Layer *next = network->getLayer(primaltimestep + 1);
-    uprimal->getLayer()->evalRegulDDT_diff(prev, next, network->getDT());
-  }
-
-  /* Derivative of tikhonov */
-  if (compute_gradient) uprimal->getLayer()->evalTikh_diff(1.0);
+  /* Take one step backwards, updates adjoint state and gradient, if desired. */
+  ApplyAdjointStep(primallayer, primalstate, u, primaltimestep, deltaT,
+                   compute_gradient);
 
   /* no refinement */
   pstatus.SetRFactor(1);
 
+  CountStep(level, GetPrimalIndex(ts_start), MPI_Wtime() - steptime);
+
   return 0;
 }
 
@@ -629,11 +1340,14 @@ braid_Int myAdjointBraidApp::Init(braid_Real t, braid_Vector *u_ptr) {
   // primaltimestep);
 
   /* Allocate the adjoint vector and set to zero */
-  myBraidVector *u = new myBraidVector(nchannels, nbatch);
+  myBraidVector *u =
+      new myBraidVector(nchannels, nbatch, network->getThreadPool());
 
   /* Adjoint initial (i.e. terminal) condition is derivative of classification
    * layer */
   if (t == 0) {
+    MyReal classtime = MPI_Wtime();
+
     /* Get the primal vector */
     _braid_UGetLast(primalcore->GetCore(), &ubaseprimal);
     uprimal = (myBraidVector *)ubaseprimal->userVector;
@@ -647,6 +1361,7 @@ braid_Int myAdjointBraidApp::Init(braid_Real t, braid_Vector *u_ptr) {
 
     /* Derivative of tikhonov regularization) */
     uprimal->getLayer()->evalTikh_diff(1.0);
+    CountPoint(ntime, MPI_Wtime() - classtime);
 
     //    printf("%d: Init_adj Loss at %d, using %1.14e, primal %1.14e, adj
     //    %1.14e, grad[0] %1.14e\n", app->myid, layer->getIndex(),
@@ -661,32 +1376,34 @@ braid_Int myAdjointBraidApp::Init(braid_Real t, braid_Vector *u_ptr) {
 
 braid_Int myAdjointBraidApp::BufSize(braid_Int *size_ptr,
                                      BraidBufferStatus &bstatus) {
-  int nchannels = network->getnChannels();
-  int nbatch = data->getnBatch();
-
-  *size_ptr = nchannels * nbatch * sizeof(MyReal);
+  /* Header and state section */
+  *size_ptr = alignMsg(sizeof(BraidMsgHeader)) + StateBufSize();
   return 0;
 }
 
 braid_Int myAdjointBraidApp::BufPack(braid_Vector u_, void *buffer,
                                      BraidBufferStatus &bstatus) {
-  int size;
-  int nchannels = network->getnChannels();
   int nbatch = data->getnBatch();
-  MyReal *dbuffer = (MyReal *)buffer;
+  char *cbuffer = (char *)buffer;
   myBraidVector *u = (myBraidVector *)u_;
+  int nchannels = u->getnChannels();
 
-  /* Store network state */
-  int idx = 0;
-  for (int iex = 0; iex < nbatch; iex++) {
-    for (int ic = 0; ic < nchannels; ic++) {
-      dbuffer[idx] = u->getState(iex)[ic];
-      idx++;
-    }
-  }
-  size = nchannels * nbatch * sizeof(MyReal);
-
-  bstatus.SetSize(size);
+  /* Set up the header. Adjoint messages don't carry a layer. */
+  BraidMsgHeader header;
+  memset(&header, 0, sizeof(BraidMsgHeader));
+  header.version = BRAID_MSG_VERSION;
+  header.nbatch = nbatch;
+  header.nchannels = nchannels;
+  header.level = u->getLevel();
+  header.haslayer = 0;
+
+  /* Pack network state and header */
+  size_t offset = alignMsg(sizeof(BraidMsgHeader));
+  PackState(u, &header, cbuffer + offset);
+  offset += header.nbytes;
+  memcpy(cbuffer, &header, sizeof(BraidMsgHeader));
+
+  bstatus.SetSize(offset);
   return 0;
 }
 
@@ -694,21 +1411,18 @@ braid_Int myAdjointBraidApp::BufUnpack(void *buffer, braid_Vector *u_ptr,
                                        BraidBufferStatus &bstatus) {
   int nchannels = network->getnChannels();
   int nbatch = data->getnBatch();
-  MyReal *dbuffer = (MyReal *)buffer;
+  char *cbuffer = (char *)buffer;
 
-  /* Allocate the vector */
-  myBraidVector *u = new myBraidVector(nchannels, nbatch);
+  /* Read and check the header */
+  BraidMsgHeader header;
+  size_t offset = 0;
+  memcpy(&header, cbuffer + offset, sizeof(BraidMsgHeader));
+  offset += alignMsg(sizeof(BraidMsgHeader));
+  checkMsgHeader(&header, nchannels, nbatch, spatial);
 
-  /* Unpack the buffer */
-  int idx = 0;
-  for (int iex = 0; iex < nbatch; iex++) {
-    for (int ic = 0; ic < nchannels; ic++) {
-      u->getState(iex)[ic] = dbuffer[idx];
-      idx++;
-    }
-  }
+  /* Unpack the state */
+  myBraidVector *u = UnpackState(&header, cbuffer + offset);
   u->setLayer(NULL);
-  u->setSendflag(-1.0);
 
   *u_ptr = (braid_Vector)u;
   return 0;
@@ -735,6 +1449,7 @@ braid_Int myAdjointBraidApp::SetInitialCondition() {
         ubaseadjoint != NULL)  // this is the case at first primal and last
                                // adjoint time step
     {
+      MyReal classtime = MPI_Wtime();
       uprimal = (myBraidVector *)ubaseprimal->userVector;
       uadjoint = (myBraidVector *)ubaseadjoint->userVector;
 
@@ -751,6 +1466,7 @@ braid_Int myAdjointBraidApp::SetInitialCondition() {
 
       /* Derivative of tikhonov regularization) */
       uprimal->getLayer()->evalTikh_diff(1.0);
+      CountPoint(ntime, MPI_Wtime() - classtime);
     }
   }
 
@@ -758,27 +1474,35 @@ braid_Int myAdjointBraidApp::SetInitialCondition() {
 }
 
 braid_Int myAdjointBraidApp::EvaluateObjective() {
-  braid_BaseVector ubase;
   myBraidVector *uadjoint;
 
   Layer *openlayer = network->getLayer(-1);
   int nbatch = data->getnBatch();
+  int nopen = openlayer != NULL ? openlayer->getnDesign() : 0;
 
-  /* Get \bar y^0 (which is the LAST xbraid vector, stored on proc 0) */
-  _braid_UGetLast(core->GetCore(), &ubase);
-  if (ubase != NULL)  // This is true only on first processor (reverted ranks!)
-  {
-    uadjoint = (myBraidVector *)ubase->userVector;
+  /* The gradient of the other layers is final now. Start averaging it over
+   * the replicas while the opening layer is computed. */
+  gradexchange->start(network->getnDesignLocal() - nopen,
+                      &(network->getGradient()[nopen]));
+
+  /* Get \bar y^0 (which is the LAST xbraid vector, stored on proc 0). This
+   * is only available on the first processor (reverted ranks!) */
+  uadjoint = GetLastState();
+  if (uadjoint != NULL) {
+    MyReal opentime = MPI_Wtime();
 
     /* Reset the gradient */
     openlayer->resetBar();
 
     /* Apply opening layer backwards for all examples */
-    for (int iex = 0; iex < nbatch; iex++) {
-      openlayer->setExample(data->getExample(iex));
-      /* TODO: Don't feed applyBWD with NULL! */
-      openlayer->applyBWD(NULL, uadjoint->getState(iex), 1);
-    }
+    network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+      for (int iex = first; iex < last; iex++) {
+        openlayer->setExample(data->getExample(iex));
+        /* TODO: Don't feed applyBWD with NULL! */
+        openlayer->applyBWD(NULL, uadjoint->getState(iex), 1);
+      }
+    });
+    openlayer->reduceBar();
 
     // printf("%d: Init_diff layerid %d using %1.14e, adj %1.14e grad[0]
     // %1.14e\n", app->myid, openlayer->getIndex(), openlayer->getWeights()[3],
@@ -786,7 +1510,11 @@ braid_Int myAdjointBraidApp::EvaluateObjective() {
 
     /* Derivative of Tikhonov Regularization */
     openlayer->evalTikh_diff(1.0);
+    CountPoint(0, MPI_Wtime() - opentime);
   }
 
+  /* Start averaging the gradient of the opening layer */
+  gradexchange->start(nopen, network->getGradient());
+
   return 0;
 }
@@ -0,0 +1,269 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "checkpoint.hpp"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+CheckpointStore::CheckpointStore(Network *Network, Config *config, int nBatch,
+                                 int iLower, int iUpper) {
+  network = Network;
+  stride = config->braid_checkpoint;
+  precision = config->braid_primalstore;
+  nbatch = nBatch;
+  nchannels = config->nchannels;
+  ilower = iLower;
+  iupper = iUpper;
+  T = config->T;
+  ntime = config->nlayers - 2;
+  usecounter = 0;
+
+  if (stride < 1) stride = 1;
+
+  /* Checkpoints are allocated on first store */
+  checkpoints = new char *[iupper - ilower + 1];
+  for (int ts = ilower; ts <= iupper; ts++) {
+    checkpoints[ts - ilower] = NULL;
+  }
+  widened = new MyReal[nbatch * nchannels];
+  widenedstep = -1;
+
+  /* Place the checkpoints in a scratch file */
+  spillfd = -1;
+  spillmap = NULL;
+  spillsize = 0;
+  spillslot = 0;
+  if (strcmp(config->braid_spilldir, "NONE") != 0) {
+    openSpillFile(config->braid_spilldir);
+  }
+
+  /* Allocate the segment cache */
+  for (int islot = 0; islot < CHECKPOINT_NSEGMENTS; islot++) {
+    segstart[islot] = -1;
+    seglastuse[islot] = 0;
+    segstates[islot] = new MyReal *[stride];
+    for (int i = 0; i < stride; i++) {
+      segstates[islot][i] = NULL;
+    }
+  }
+}
+
+CheckpointStore::~CheckpointStore() {
+  if (spillfd >= 0) {
+    munmap(spillmap, spillsize);
+    close(spillfd);
+  } else {
+    for (int ts = ilower; ts <= iupper; ts++) {
+      delete[] checkpoints[ts - ilower];
+    }
+  }
+  delete[] checkpoints;
+  delete[] widened;
+
+  for (int islot = 0; islot < CHECKPOINT_NSEGMENTS; islot++) {
+    for (int i = 0; i < stride; i++) {
+      delete[] segstates[islot][i];
+    }
+    delete[] segstates[islot];
+  }
+}
+
+void CheckpointStore::openSpillFile(const char *dir) {
+  char filename[CONFIG_ARG_MAX_BYTES + 32];
+  int ncheckpoints = 0;
+
+  /* Create the file and unlink it right away, so it is removed on exit */
+  sprintf(filename, "%s/primalstore.XXXXXX", dir);
+  spillfd = mkstemp(filename);
+  if (spillfd < 0) {
+    printf("\n\n ERROR: Can't create a scratch file in %s!\n\n", dir);
+    exit(1);
+  }
+  unlink(filename);
+
+  /* One slot of whole pages per checkpoint */
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  spillslot = compressBound(precision, nbatch * nchannels);
+  spillslot = (spillslot + pagesize - 1) / pagesize * pagesize;
+  for (int ts = ilower; ts <= iupper; ts++) {
+    if (isCheckpoint(ts)) ncheckpoints++;
+  }
+  spillsize = ncheckpoints * spillslot;
+
+  if (ftruncate(spillfd, spillsize) != 0) {
+    printf("\n\n ERROR: Can't resize the scratch file in %s!\n\n", dir);
+    exit(1);
+  }
+  spillmap = (char *)mmap(NULL, spillsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          spillfd, 0);
+  if (spillmap == MAP_FAILED) {
+    printf("\n\n ERROR: Can't map the scratch file in %s!\n\n", dir);
+    exit(1);
+  }
+
+  /* The adjoint reads the checkpoints backwards */
+  madvise(spillmap, spillsize, MADV_RANDOM);
+
+  /* Place the checkpoints */
+  int islot = 0;
+  for (int ts = ilower; ts <= iupper; ts++) {
+    if (isCheckpoint(ts)) {
+      checkpoints[ts - ilower] = spillmap + islot * spillslot;
+      islot++;
+    }
+  }
+}
+
+void CheckpointStore::writeBehind(int ts) {
+  if (spillfd < 0) return;
+
+  char *checkpoint = checkpoints[ts - ilower];
+#ifdef __linux__
+  off_t offset = checkpoint - spillmap;
+  sync_file_range(spillfd, offset, spillslot, SYNC_FILE_RANGE_WRITE);
+#else
+  msync(checkpoint, spillslot, MS_ASYNC);
+#endif
+}
+
+void CheckpointStore::readAhead(int ts) {
+  if (spillfd < 0) return;
+
+  madvise(checkpoints[ts - ilower], spillslot, MADV_WILLNEED);
+}
+
+int CheckpointStore::isCheckpoint(int ts) {
+  if (ts == ilower || ts % stride == 0) return 1;
+  return 0;
+}
+
+int CheckpointStore::getCheckpoint(int ts) {
+  int checkpoint = ts - ts % stride;
+  if (checkpoint < ilower) checkpoint = ilower;
+  return checkpoint;
+}
+
+void CheckpointStore::storeState(int ts, MyReal *state) {
+  if (ts < ilower || ts > iupper || !isCheckpoint(ts)) return;
+
+  int size = nbatch * nchannels;
+  char *checkpoint = checkpoints[ts - ilower];
+  if (checkpoint == NULL) {
+    checkpoint = new char[compressBound(precision, size)];
+    checkpoints[ts - ilower] = checkpoint;
+  }
+  compressState(precision, 0.0, size, state, checkpoint,
+                network->getThreadPool());
+  writeBehind(ts);
+
+  /* Widened and recomputed states are outdated now */
+  widenedstep = -1;
+  for (int islot = 0; islot < CHECKPOINT_NSEGMENTS; islot++) {
+    segstart[islot] = -1;
+  }
+}
+
+void CheckpointStore::recomputeSegment(int checkpoint, int islot) {
+  int size = nbatch * nchannels;
+
+  if (checkpoints[checkpoint - ilower] == NULL) {
+    printf("\n\n ERROR: No checkpoint stored at time step %d!\n\n",
+           checkpoint);
+    exit(1);
+  }
+
+  /* Step forward from the checkpoint up to the next one */
+  for (int i = 0; i < stride - 1; i++) {
+    int ts = checkpoint + i;
+    if (ts + 1 > iupper || isCheckpoint(ts + 1)) break;
+
+    if (segstates[islot][i] == NULL) segstates[islot][i] = new MyReal[size];
+    MyReal *state = segstates[islot][i];
+    if (i == 0) {
+      decompressState(precision, size, checkpoints[checkpoint - ilower],
+                      state, network->getThreadPool());
+    } else {
+      memcpy(state, segstates[islot][i - 1], size * sizeof(MyReal));
+    }
+
+    /* Same time step size as braid on the fine grid */
+    MyReal tstart = (ts / (MyReal)ntime) * T;
+    MyReal tstop = ((ts + 1) / (MyReal)ntime) * T;
+    Layer *layer = network->getLayer(ts);
+    layer->setDt(tstop - tstart);
+    network->getThreadPool()->parallelFor(nbatch, [&](int first, int last) {
+      for (int iex = first; iex < last; iex++) {
+        layer->applyFWD(&(state[iex * nchannels]));
+      }
+    });
+    layer->gatherTensorSlices(nbatch, state);
+  }
+
+  segstart[islot] = checkpoint;
+}
+
+MyReal *CheckpointStore::getState(int ts) {
+  if (ts < ilower || ts > iupper) {
+    printf("\n\n ERROR: Primal state %d is not stored on this processor!\n\n",
+           ts);
+    exit(1);
+  }
+
+  /* Read ahead the checkpoint that comes next in the adjoint sweep */
+  int previous = getCheckpoint(ts) - 1;
+  if (previous >= ilower) readAhead(getCheckpoint(previous));
+
+  /* Widen the checkpoint */
+  if (isCheckpoint(ts)) {
+    if (checkpoints[ts - ilower] == NULL) {
+      printf("\n\n ERROR: No checkpoint stored at time step %d!\n\n", ts);
+      exit(1);
+    }
+    if (widenedstep != ts) {
+      decompressState(precision, nbatch * nchannels,
+                      checkpoints[ts - ilower], widened,
+                      network->getThreadPool());
+      widenedstep = ts;
+    }
+    return widened;
+  }
+
+  usecounter++;
+
+  /* Look up the segment in the cache, else recompute it in place of the
+   * least recently used one */
+  int checkpoint = getCheckpoint(ts);
+  int islot = 0;
+  for (int i = 0; i < CHECKPOINT_NSEGMENTS; i++) {
+    if (segstart[i] == checkpoint) {
+      islot = i;
+      break;
+    }
+    if (seglastuse[i] < seglastuse[islot]) islot = i;
+  }
+  if (segstart[islot] != checkpoint) recomputeSegment(checkpoint, islot);
+  seglastuse[islot] = usecounter;
+
+  return segstates[islot][ts - checkpoint - 1];
+}
@@ -0,0 +1,127 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "coarseprop.hpp"
+
+CoarsePropagator::CoarsePropagator(Network *Network, Config *Config,
+                                   SpatialCoarsening *Spatial) {
+  network = Network;
+  config = Config;
+  spatial = Spatial;
+  type = config->braid_coarseprop;
+  rank = config->braid_coarserank;
+  niter = 4;
+
+  /* Low rank layers need dense weights */
+  if (type == COARSEPROP_LOWRANK && config->network_type != DENSE) {
+    type = COARSEPROP_AVERAGE;
+  }
+}
+
+CoarsePropagator::~CoarsePropagator() {
+  std::map<std::tuple<int, int, int>, Layer *>::iterator it;
+  for (it = layers.begin(); it != layers.end(); it++) {
+    delete[] it->second->getWeights();
+    delete[] it->second->getWeightsBar();
+    delete it->second;
+  }
+}
+
+int CoarsePropagator::getType() { return type; }
+
+int CoarsePropagator::isAveraged(int first, int last) {
+  return type != COARSEPROP_LAYER && last - first > 1;
+}
+
+void CoarsePropagator::setDesign(Layer *layer, int first, int last,
+                                 int res) {
+  /* Most of the fine layers are fetched from processors that are neither
+   * neighbours nor the sender of the message. Their owners have published
+   * the current version before this solve (see Network::publishDesign). */
+  int version = network->getDesignVersion();
+  Layer *fine = network->getRemoteLayer(first, version);
+  int ndesign = fine->getnDesign();
+  MyReal *average = new MyReal[ndesign];
+
+  /* Average the weights and biases of the fine layers (or take the first) */
+  if (!isAveraged(first, last)) last = first + 1;
+  for (int i = 0; i < ndesign; i++) average[i] = 0.0;
+  for (int ts = first; ts < last; ts++) {
+    fine = network->getRemoteLayer(ts, version);
+    MyReal *design = fine->getWeights();
+    for (int i = 0; i < ndesign; i++) average[i] += design[i];
+  }
+  for (int i = 0; i < ndesign; i++) average[i] /= (last - first);
+
+  if (type == COARSEPROP_LOWRANK) {
+    /* The bias follows the nchannels x nchannels weights */
+    ((LowRankLayer *)layer)
+        ->approximate(average, average[fine->getnWeights()], niter);
+  } else {
+    /* Coarsen the design to the resolution */
+    for (int r = 0; r < res; r++) {
+      MyReal *coarse = new MyReal[ndesign];
+      spatial->coarsenDesign(r, average, coarse);
+      delete[] average;
+      average = coarse;
+    }
+    memcpy(layer->getWeights(), average, layer->getnDesign() * sizeof(MyReal));
+  }
+
+  delete[] average;
+}
+
+Layer *CoarsePropagator::getLayer(int first, int last, int res) {
+  if (res == 0 && !isAveraged(first, last)) return NULL;
+
+  /* Set up the layer on first use */
+  std::tuple<int, int, int> key(first, last, res);
+  Layer *layer = layers[key];
+  if (layer == NULL) {
+    if (res > 0) {
+      int nchannels = spatial->getnChannels(res);
+      layer = new ConvLayer(first, nchannels, nchannels, 3, spatial->getnConv(),
+                            network->getDT(), config->activation, 0.0, 0.0);
+      layer->setnThreads(network->getThreadPool()->getnThreads());
+    } else if (type == COARSEPROP_LOWRANK) {
+      layer = new LowRankLayer(first, network->getnChannels(), rank,
+                               network->getDT(), config->activation);
+      layer->setnThreads(network->getThreadPool()->getnThreads());
+    } else {
+      layer = network->createLayer(first, config);
+    }
+    int ndesign = layer->getnDesign();
+    MyReal *design = new MyReal[ndesign];
+    MyReal *gradient = new MyReal[ndesign];
+    for (int i = 0; i < ndesign; i++) gradient[i] = 0.0;
+    layer->setMemory(design, gradient);
+    layers[key] = layer;
+    versions[key] = -1;
+  }
+
+  /* Update the design */
+  if (versions[key] != network->getDesignVersion()) {
+    setDesign(layer, first, last, res);
+    versions[key] = network->getDesignVersion();
+  }
+
+  return layer;
+}
@@ -0,0 +1,290 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "compress.hpp"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+/* Header of a quantized state */
+struct QuantizeHeader {
+  MyReal min;  /* Value of code 0 */
+  MyReal step; /* Distance of two codes */
+  int nbits;   /* Bits per code (8 or 16), 0 if values are not quantized */
+};
+
+/* Round a float to bfloat16 (round to nearest even) */
+static uint16_t float2bf16(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(float));
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    /* NaN: keep it a NaN */
+    return (uint16_t)((bits >> 16) | 0x0040);
+  }
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return (uint16_t)(bits >> 16);
+}
+
+static float bf162float(uint16_t x) {
+  uint32_t bits = ((uint32_t)x) << 16;
+  float y;
+  memcpy(&y, &bits, sizeof(float));
+  return y;
+}
+
+size_t compressBound(int type, int n) {
+  size_t size = 0;
+
+  switch (type) {
+    case COMPRESS_FP32:
+      size = n * sizeof(float);
+      break;
+    case COMPRESS_BF16:
+      size = n * sizeof(uint16_t);
+      break;
+    case COMPRESS_QUANTIZE:
+      /* Worst case: fall back to uncompressed values */
+      size = sizeof(QuantizeHeader) + n * sizeof(MyReal);
+      break;
+    default:
+      size = n * sizeof(MyReal);
+  }
+
+  return size;
+}
+
+/* Call body on chunks of [0, n), in parallel if a thread pool is given */
+static void forChunks(ThreadPool *threads, int n,
+                      const std::function<void(int, int)> &body) {
+  if (threads != NULL) {
+    threads->parallelFor(n, body);
+  } else if (n > 0) {
+    body(0, n);
+  }
+}
+
+/* Copy n values in chunks */
+static void copyValues(ThreadPool *threads, int n, const MyReal *src,
+                       MyReal *dst) {
+  forChunks(threads, n, [&](int first, int last) {
+    memcpy(dst + first, src + first, (last - first) * sizeof(MyReal));
+  });
+}
+
+int compressType(int type, MyReal tol, int n, MyReal *x,
+                 ThreadPool *threads) {
+  MyReal unitround;
+
+  /* Relative error of rounding to nearest */
+  switch (type) {
+    case COMPRESS_FP32:
+      unitround = ldexp(1.0, -24);
+      break;
+    case COMPRESS_BF16:
+      unitround = ldexp(1.0, -8);
+      break;
+    default:
+      return type;
+  }
+  if (tol <= 0.0) return COMPRESS_NONE;
+
+  /* Largest magnitude, per thread and then over the threads (exact, the
+   * result doesn't depend on the chunks) */
+  int nthreads = threads != NULL ? threads->getnThreads() : 1;
+  std::vector<MyReal> chunkmax(nthreads, 0.0);
+  forChunks(threads, n, [&](int first, int last) {
+    int tid = ThreadPool::getThreadID();
+    MyReal cmax = chunkmax[tid];
+    for (int i = first; i < last; i++) cmax = std::max(cmax, fabs(x[i]));
+    chunkmax[tid] = cmax;
+  });
+  MyReal maxabs = 0.0;
+  for (int t = 0; t < nthreads; t++) maxabs = std::max(maxabs, chunkmax[t]);
+
+  if (!isfinite(maxabs) || unitround * maxabs > tol) return COMPRESS_NONE;
+  return type;
+}
+
+size_t compressState(int type, MyReal tol, int n, MyReal *x, char *buffer,
+                     ThreadPool *threads) {
+  size_t size = 0;
+
+  switch (type) {
+    case COMPRESS_FP32: {
+      float *fbuffer = (float *)buffer;
+      forChunks(threads, n, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+          fbuffer[i] = (float)x[i];
+        }
+      });
+      size = n * sizeof(float);
+      break;
+    }
+    case COMPRESS_BF16: {
+      uint16_t *bfbuffer = (uint16_t *)buffer;
+      forChunks(threads, n, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+          bfbuffer[i] = float2bf16((float)x[i]);
+        }
+      });
+      size = n * sizeof(uint16_t);
+      break;
+    }
+    case COMPRESS_QUANTIZE: {
+      QuantizeHeader header;
+      char *codes = buffer + sizeof(QuantizeHeader);
+
+      /* Get the range of the values, per chunk and then over the chunks
+       * (min and max are exact, the result doesn't depend on the chunks) */
+      int nthreads = threads != NULL ? threads->getnThreads() : 1;
+      MyReal *chunkmin = new MyReal[nthreads];
+      MyReal *chunkmax = new MyReal[nthreads];
+      int *chunkused = new int[nthreads];
+      for (int t = 0; t < nthreads; t++) chunkused[t] = 0;
+      forChunks(threads, n, [&](int first, int last) {
+        int tid = ThreadPool::getThreadID();
+        MyReal cmin = x[first];
+        MyReal cmax = x[first];
+        for (int i = first + 1; i < last; i++) {
+          if (x[i] < cmin) cmin = x[i];
+          if (x[i] > cmax) cmax = x[i];
+        }
+        /* A thread may get several sub-chunks (see ThreadPool::setProgress) */
+        if (chunkused[tid]) {
+          cmin = std::min(cmin, chunkmin[tid]);
+          cmax = std::max(cmax, chunkmax[tid]);
+        }
+        chunkmin[tid] = cmin;
+        chunkmax[tid] = cmax;
+        chunkused[tid] = 1;
+      });
+      MyReal min = 0.0;
+      MyReal max = 0.0;
+      int found = 0;
+      for (int t = 0; t < nthreads; t++) {
+        if (!chunkused[t]) continue;
+        if (!found || chunkmin[t] < min) min = chunkmin[t];
+        if (!found || chunkmax[t] > max) max = chunkmax[t];
+        found = 1;
+      }
+      delete[] chunkmin;
+      delete[] chunkmax;
+      delete[] chunkused;
+
+      /* Choose the code width. Codes are rounded to nearest, so the error is
+       * at most step/2 = tol. */
+      header.min = min;
+      header.step = 2.0 * tol;
+      header.nbits = 0;
+      if (tol > 0.0 && isfinite(min) && isfinite(max)) {
+        MyReal ncodes = floor((max - min) / header.step) + 1.0;
+        if (ncodes <= 256.0) {
+          header.nbits = 8;
+        } else if (ncodes <= 65536.0) {
+          header.nbits = 16;
+        }
+      }
+
+      /* Store the codes */
+      if (header.nbits == 8) {
+        uint8_t *code8 = (uint8_t *)codes;
+        forChunks(threads, n, [&](int first, int last) {
+          for (int i = first; i < last; i++) {
+            code8[i] = (uint8_t)floor((x[i] - min) / header.step + 0.5);
+          }
+        });
+        size = n * sizeof(uint8_t);
+      } else if (header.nbits == 16) {
+        uint16_t *code16 = (uint16_t *)codes;
+        forChunks(threads, n, [&](int first, int last) {
+          for (int i = first; i < last; i++) {
+            code16[i] = (uint16_t)floor((x[i] - min) / header.step + 0.5);
+          }
+        });
+        size = n * sizeof(uint16_t);
+      } else {
+        copyValues(threads, n, x, (MyReal *)codes);
+        size = n * sizeof(MyReal);
+      }
+      memcpy(buffer, &header, sizeof(QuantizeHeader));
+      size += sizeof(QuantizeHeader);
+      break;
+    }
+    default:
+      copyValues(threads, n, x, (MyReal *)buffer);
+      size = n * sizeof(MyReal);
+  }
+
+  return size;
+}
+
+void decompressState(int type, int n, char *buffer, MyReal *x,
+                     ThreadPool *threads) {
+  switch (type) {
+    case COMPRESS_FP32: {
+      float *fbuffer = (float *)buffer;
+      forChunks(threads, n, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+          x[i] = fbuffer[i];
+        }
+      });
+      break;
+    }
+    case COMPRESS_BF16: {
+      uint16_t *bfbuffer = (uint16_t *)buffer;
+      forChunks(threads, n, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+          x[i] = bf162float(bfbuffer[i]);
+        }
+      });
+      break;
+    }
+    case COMPRESS_QUANTIZE: {
+      QuantizeHeader header;
+      char *codes = buffer + sizeof(QuantizeHeader);
+      memcpy(&header, buffer, sizeof(QuantizeHeader));
+
+      if (header.nbits == 8) {
+        uint8_t *code8 = (uint8_t *)codes;
+        forChunks(threads, n, [&](int first, int last) {
+          for (int i = first; i < last; i++) {
+            x[i] = header.min + code8[i] * header.step;
+          }
+        });
+      } else if (header.nbits == 16) {
+        uint16_t *code16 = (uint16_t *)codes;
+        forChunks(threads, n, [&](int first, int last) {
+          for (int i = first; i < last; i++) {
+            x[i] = header.min + code16[i] * header.step;
+          }
+        });
+      } else {
+        copyValues(threads, n, (MyReal *)codes, x);
+      }
+      break;
+    }
+    default:
+      copyValues(threads, n, (MyReal *)buffer, x);
+  }
+}
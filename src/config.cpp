@@ -24,6 +24,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 
 Config::Config() {
   /* --- Set DEFAULT parameters of the config file options --- */
@@ -58,19 +59,46 @@ Config::Config() {
   braid_cfactor = 4;
   braid_maxlevels = 10;
   braid_mincoarse = 10;
+  braid_mincoarseproc = 0;
   braid_maxiter = 3;
   braid_abstol = 1e-10;
-  braid_abstoladj = 1e-06;
+  braid_abstoladj = -1.0;
+  braid_maxiteradj = -1;
+  braid_inexact = 0;
+  braid_inexactfactor = 0.1;
   braid_printlevel = 1;
   braid_accesslevel = 0;
   braid_setskip = 0;
   braid_fmg = 0;
   braid_nrelax0 = 1;
   braid_nrelax = 1;
+  braid_compress = COMPRESS_NONE;
+  braid_compresstol = 1e-2;
+  braid_shmslots = 0;
+  braid_checkpoint = 0;
+  braid_primalstore = COMPRESS_NONE;
+  braid_spilldir = "NONE";
+  braid_nthreads = 1;
+  braid_ftasks = 0;
+  braid_progress = 0;
+  braid_progresscompare = 0;
+  braid_pinning = PIN_NONE;
+  braid_hugepages = 0;
+  braid_coarseprop = COARSEPROP_LAYER;
+  braid_coarserank = 2;
+  braid_spatialcoarsen = 0;
+  braid_warmstart = WARMSTART_GRID;
+  braid_serial = SERIAL_OFF;
 
   /* Optimization */
   batch_type = DETERMINISTIC;
   nbatch = ntraining;  // full batch
+  nreplicas = 1;
+  ntensor = 1;
+  gradient_bucketsize = 0;
+  gradient_compress = GRADCOMPRESS_NONE;
+  gradient_topk = 0.01;
+  gradient_verify = 0;
   gamma_tik = 1e-07;
   gamma_ddt = 1e-07;
   gamma_class = 1e-07;
@@ -80,6 +108,8 @@ Config::Config() {
   gtol = 1e-08;
   ls_maxiter = 20;
   ls_factor = 0.5;
+  optim_oneshot = 0;
+  optim_oneshotrtol = 1.0;
   hessianapprox_type = LBFGS;
   lbfgs_stages = 20;
   validationlevel = 1;
@@ -163,12 +193,20 @@ int Config::readFromFile(char *configfilename) {
       braid_maxlevels = atoi(co->value);
     } else if (strcmp(co->key, "braid_mincoarse") == 0) {
       braid_mincoarse = atoi(co->value);
+    } else if (strcmp(co->key, "braid_mincoarseproc") == 0) {
+      braid_mincoarseproc = atoi(co->value);
     } else if (strcmp(co->key, "braid_maxiter") == 0) {
       braid_maxiter = atoi(co->value);
     } else if (strcmp(co->key, "braid_abstol") == 0) {
       braid_abstol = atof(co->value);
     } else if (strcmp(co->key, "braid_adjtol") == 0) {
       braid_abstoladj = atof(co->value);
+    } else if (strcmp(co->key, "braid_maxiteradj") == 0) {
+      braid_maxiteradj = atoi(co->value);
+    } else if (strcmp(co->key, "braid_inexact") == 0) {
+      braid_inexact = atoi(co->value);
+    } else if (strcmp(co->key, "braid_inexactfactor") == 0) {
+      braid_inexactfactor = atof(co->value);
     } else if (strcmp(co->key, "braid_printlevel") == 0) {
       braid_printlevel = atoi(co->value);
     } else if (strcmp(co->key, "braid_accesslevel") == 0) {
@@ -181,6 +219,101 @@ int Config::readFromFile(char *configfilename) {
       braid_nrelax = atoi(co->value);
     } else if (strcmp(co->key, "braid_nrelax0") == 0) {
       braid_nrelax0 = atoi(co->value);
+    } else if (strcmp(co->key, "braid_compress") == 0) {
+      if (strcmp(co->value, "none") == 0) {
+        braid_compress = COMPRESS_NONE;
+      } else if (strcmp(co->value, "fp32") == 0) {
+        braid_compress = COMPRESS_FP32;
+      } else if (strcmp(co->value, "bf16") == 0) {
+        braid_compress = COMPRESS_BF16;
+      } else if (strcmp(co->value, "quantize") == 0) {
+        braid_compress = COMPRESS_QUANTIZE;
+      } else {
+        printf("Invalid braid_compress! Should be 'none', 'fp32', 'bf16' or "
+               "'quantize'!");
+        return -1;
+      }
+    } else if (strcmp(co->key, "braid_compresstol") == 0) {
+      braid_compresstol = atof(co->value);
+    } else if (strcmp(co->key, "braid_shmslots") == 0) {
+      braid_shmslots = atoi(co->value);
+    } else if (strcmp(co->key, "braid_checkpoint") == 0) {
+      braid_checkpoint = atoi(co->value);
+    } else if (strcmp(co->key, "braid_primalstore") == 0) {
+      if (strcmp(co->value, "full") == 0) {
+        braid_primalstore = COMPRESS_NONE;
+      } else if (strcmp(co->value, "fp32") == 0) {
+        braid_primalstore = COMPRESS_FP32;
+      } else if (strcmp(co->value, "bf16") == 0) {
+        braid_primalstore = COMPRESS_BF16;
+      } else {
+        printf("Invalid braid_primalstore! Should be 'full', 'fp32' or "
+               "'bf16'!");
+        return -1;
+      }
+    } else if (strcmp(co->key, "braid_spilldir") == 0) {
+      braid_spilldir = co->value;
+    } else if (strcmp(co->key, "braid_nthreads") == 0) {
+      braid_nthreads = atoi(co->value);
+    } else if (strcmp(co->key, "braid_ftasks") == 0) {
+      braid_ftasks = atoi(co->value);
+    } else if (strcmp(co->key, "braid_progress") == 0) {
+      braid_progress = atoi(co->value);
+    } else if (strcmp(co->key, "braid_progresscompare") == 0) {
+      braid_progresscompare = atoi(co->value);
+    } else if (strcmp(co->key, "braid_pinning") == 0) {
+      if (strcmp(co->value, "none") == 0) {
+        braid_pinning = PIN_NONE;
+      } else if (strcmp(co->value, "compact") == 0) {
+        braid_pinning = PIN_COMPACT;
+      } else if (strcmp(co->value, "scatter") == 0) {
+        braid_pinning = PIN_SCATTER;
+      } else {
+        printf("Invalid braid_pinning! Should be 'none', 'compact' or "
+               "'scatter'!");
+        return -1;
+      }
+    } else if (strcmp(co->key, "braid_hugepages") == 0) {
+      braid_hugepages = atoi(co->value);
+    } else if (strcmp(co->key, "braid_coarseprop") == 0) {
+      if (strcmp(co->value, "layer") == 0) {
+        braid_coarseprop = COARSEPROP_LAYER;
+      } else if (strcmp(co->value, "average") == 0) {
+        braid_coarseprop = COARSEPROP_AVERAGE;
+      } else if (strcmp(co->value, "lowrank") == 0) {
+        braid_coarseprop = COARSEPROP_LOWRANK;
+      } else {
+        printf("Invalid braid_coarseprop! Should be 'layer', 'average' or "
+               "'lowrank'!");
+        return -1;
+      }
+    } else if (strcmp(co->key, "braid_coarserank") == 0) {
+      braid_coarserank = atoi(co->value);
+    } else if (strcmp(co->key, "braid_spatialcoarsen") == 0) {
+      braid_spatialcoarsen = atoi(co->value);
+    } else if (strcmp(co->key, "braid_warmstart") == 0) {
+      if (strcmp(co->value, "none") == 0) {
+        braid_warmstart = WARMSTART_NONE;
+      } else if (strcmp(co->value, "grid") == 0) {
+        braid_warmstart = WARMSTART_GRID;
+      } else if (strcmp(co->value, "sweep") == 0) {
+        braid_warmstart = WARMSTART_SWEEP;
+      } else {
+        printf("Invalid braid_warmstart! Should be 'none', 'grid' or "
+               "'sweep'!");
+        return -1;
+      }
+    } else if (strcmp(co->key, "braid_serial") == 0) {
+      if (strcmp(co->value, "off") == 0) {
+        braid_serial = SERIAL_OFF;
+      } else if (strcmp(co->value, "on") == 0) {
+        braid_serial = SERIAL_ON;
+      } else if (strcmp(co->value, "auto") == 0) {
+        braid_serial = SERIAL_AUTO;
+      } else {
+        printf("Invalid braid_serial! Should be 'off', 'on' or 'auto'!");
+        return -1;
+      }
     } else if (strcmp(co->key, "batch_type") == 0) {
       if (strcmp(co->value, "deterministic") == 0) {
         batch_type = DETERMINISTIC;
@@ -194,6 +327,30 @@ int Config::readFromFile(char *configfilename) {
       }
     } else if (strcmp(co->key, "nbatch") == 0) {
       nbatch = atoi(co->value);
+    } else if (strcmp(co->key, "nreplicas") == 0) {
+      nreplicas = atoi(co->value);
+    } else if (strcmp(co->key, "ntensor") == 0) {
+      ntensor = atoi(co->value);
+    } else if (strcmp(co->key, "gradient_bucketsize") == 0) {
+      gradient_bucketsize = atoi(co->value);
+    } else if (strcmp(co->key, "gradient_compress") == 0) {
+      if (strcmp(co->value, "none") == 0) {
+        gradient_compress = GRADCOMPRESS_NONE;
+      } else if (strcmp(co->value, "fp32") == 0) {
+        gradient_compress = GRADCOMPRESS_FP32;
+      } else if (strcmp(co->value, "bf16") == 0) {
+        gradient_compress = GRADCOMPRESS_BF16;
+      } else if (strcmp(co->value, "topk") == 0) {
+        gradient_compress = GRADCOMPRESS_TOPK;
+      } else {
+        printf("Invalid gradient_compress! Should be 'none', 'fp32', 'bf16' "
+               "or 'topk'!");
+        return -1;
+      }
+    } else if (strcmp(co->key, "gradient_topk") == 0) {
+      gradient_topk = atof(co->value);
+    } else if (strcmp(co->key, "gradient_verify") == 0) {
+      gradient_verify = atoi(co->value);
     } else if (strcmp(co->key, "gamma_tik") == 0) {
       gamma_tik = atof(co->value);
     } else if (strcmp(co->key, "gamma_ddt") == 0) {
@@ -223,6 +380,10 @@ int Config::readFromFile(char *configfilename) {
       ls_maxiter = atoi(co->value);
     } else if (strcmp(co->key, "ls_factor") == 0) {
       ls_factor = atof(co->value);
+    } else if (strcmp(co->key, "optim_oneshot") == 0) {
+      optim_oneshot = atoi(co->value);
+    } else if (strcmp(co->key, "optim_oneshotrtol") == 0) {
+      optim_oneshotrtol = atof(co->value);
     } else if (strcmp(co->key, "weights_open_init") == 0) {
       weights_open_init = atof(co->value);
     } else if (strcmp(co->key, "type_openlayer") == 0) {
@@ -262,6 +423,11 @@ int Config::readFromFile(char *configfilename) {
     }
   }
 
+  /* The adjoint solves take the primal tolerance and iteration cap by
+   * default */
+  if (braid_abstoladj < 0.0) braid_abstoladj = braid_abstol;
+  if (braid_maxiteradj < 0) braid_maxiteradj = braid_maxiter;
+
   /* Sanity check */
   if (nfeatures > nchannels || nclasses > nchannels) {
     printf("ERROR! Choose a wider netword!\n");
@@ -314,7 +480,9 @@ Config::config_option *Config::parsefile(char *path) {
 
 int Config::writeToFile(FILE *outfile) {
   const char *activname, *networktypename, *hessetypename, *optimtypename,
-      *stepsizetypename;
+      *stepsizetypename, *compresstypename, *primalstorename,
+      *pinningtypename, *gradcompressname, *coarsepropname,
+      *warmstartname, *serialname;
 
   /* Get names of some int options */
   switch (activation) {
@@ -376,6 +544,103 @@ int Config::writeToFile(FILE *outfile) {
     default:
       stepsizetypename = "invalid!";
   }
+  switch (braid_compress) {
+    case COMPRESS_NONE:
+      compresstypename = "none";
+      break;
+    case COMPRESS_FP32:
+      compresstypename = "fp32";
+      break;
+    case COMPRESS_BF16:
+      compresstypename = "bf16";
+      break;
+    case COMPRESS_QUANTIZE:
+      compresstypename = "quantize";
+      break;
+    default:
+      compresstypename = "invalid!";
+  }
+  switch (braid_primalstore) {
+    case COMPRESS_NONE:
+      primalstorename = "full";
+      break;
+    case COMPRESS_FP32:
+      primalstorename = "fp32";
+      break;
+    case COMPRESS_BF16:
+      primalstorename = "bf16";
+      break;
+    default:
+      primalstorename = "invalid!";
+  }
+  switch (braid_pinning) {
+    case PIN_NONE:
+      pinningtypename = "none";
+      break;
+    case PIN_COMPACT:
+      pinningtypename = "compact";
+      break;
+    case PIN_SCATTER:
+      pinningtypename = "scatter";
+      break;
+    default:
+      pinningtypename = "invalid!";
+  }
+  switch (braid_coarseprop) {
+    case COARSEPROP_LAYER:
+      coarsepropname = "layer";
+      break;
+    case COARSEPROP_AVERAGE:
+      coarsepropname = "average";
+      break;
+    case COARSEPROP_LOWRANK:
+      coarsepropname = "lowrank";
+      break;
+    default:
+      coarsepropname = "invalid!";
+  }
+  switch (braid_warmstart) {
+    case WARMSTART_NONE:
+      warmstartname = "none";
+      break;
+    case WARMSTART_GRID:
+      warmstartname = "grid";
+      break;
+    case WARMSTART_SWEEP:
+      warmstartname = "sweep";
+      break;
+    default:
+      warmstartname = "invalid!";
+  }
+  switch (braid_serial) {
+    case SERIAL_OFF:
+      serialname = "off";
+      break;
+    case SERIAL_ON:
+      serialname = "on";
+      break;
+    case SERIAL_AUTO:
+      serialname = "auto";
+      break;
+    default:
+      serialname = "invalid!";
+  }
+  switch (gradient_compress) {
+    case GRADCOMPRESS_NONE:
+      gradcompressname = "none";
+      break;
+    case GRADCOMPRESS_FP32:
+      gradcompressname = "fp32";
+      break;
+    case GRADCOMPRESS_BF16:
+      gradcompressname = "bf16";
+      break;
+    case GRADCOMPRESS_TOPK:
+      gradcompressname = "topk";
+      break;
+    default:
+      gradcompressname = "invalid!";
+  }
 
   /* print config option */
   fprintf(outfile, "# Problem setup: datafolder           %s \n", datafolder);
@@ -400,6 +665,8 @@ int Config::writeToFile(FILE *outfile) {
           braid_maxlevels);
   fprintf(outfile, "#                min coarse           %d \n",
           braid_mincoarse);
+  fprintf(outfile, "#                min coarse per proc  %d \n",
+          braid_mincoarseproc);
   fprintf(outfile, "#                coasening            %d \n",
           braid_cfactor);
   fprintf(outfile, "#                coasening (level 0)  %d \n",
@@ -410,6 +677,12 @@ int Config::writeToFile(FILE *outfile) {
           braid_abstol);
   fprintf(outfile, "#                abs. toladj          %1.e \n",
           braid_abstoladj);
+  fprintf(outfile, "#                max. braid iter adj  %d \n",
+          braid_maxiteradj);
+  fprintf(outfile, "#                inexact solves       %d \n",
+          braid_inexact);
+  fprintf(outfile, "#                inexact tol factor   %1.e \n",
+          braid_inexactfactor);
   fprintf(outfile, "#                print level          %d \n",
           braid_printlevel);
   fprintf(outfile, "#                access level         %d \n",
@@ -420,9 +693,54 @@ int Config::writeToFile(FILE *outfile) {
   fprintf(outfile, "#                nrelax (level 0)     %d \n",
           braid_nrelax0);
   fprintf(outfile, "#                nrelax               %d \n", braid_nrelax);
+  fprintf(outfile, "#                compression          %s \n",
+          compresstypename);
+  fprintf(outfile, "#                compression tol      %1.e \n",
+          braid_compresstol);
+  fprintf(outfile, "#                shm slots            %d \n",
+          braid_shmslots);
+  fprintf(outfile, "#                checkpoint stride    %d \n",
+          braid_checkpoint);
+  fprintf(outfile, "#                primal store         %s \n",
+          primalstorename);
+  fprintf(outfile, "#                spill directory      %s \n",
+          braid_spilldir);
+  fprintf(outfile, "#                nthreads             %d \n",
+          braid_nthreads);
+  fprintf(outfile, "#                F-interval tasks     %d \n",
+          braid_ftasks);
+  fprintf(outfile, "#                progress interval    %d \n",
+          braid_progress);
+  fprintf(outfile, "#                progress comparison  %d \n",
+          braid_progresscompare);
+  fprintf(outfile, "#                thread pinning       %s \n",
+          pinningtypename);
+  fprintf(outfile, "#                huge pages           %d \n",
+          braid_hugepages);
+  fprintf(outfile, "#                coarse propagator    %s \n",
+          coarsepropname);
+  fprintf(outfile, "#                coarse rank          %d \n",
+          braid_coarserank);
+  fprintf(outfile, "#                spatial coarsening   %d \n",
+          braid_spatialcoarsen);
+  fprintf(outfile, "#                warm start           %s \n",
+          warmstartname);
+  fprintf(outfile, "#                serial sweeps        %s \n",
+          serialname);
   fprintf(outfile, "# Optimization:  optimization type    %s \n",
           optimtypename);
   fprintf(outfile, "#                nbatch               %d \n", nbatch);
+  fprintf(outfile, "#                nreplicas            %d \n",
+          nreplicas);
+  fprintf(outfile, "#                ntensor              %d \n", ntensor);
+  fprintf(outfile, "#                gradient bucket size %d \n",
+          gradient_bucketsize);
+  fprintf(outfile, "#                gradient compression %s \n",
+          gradcompressname);
+  fprintf(outfile, "#                gradient top-k       %1.e \n",
+          gradient_topk);
+  fprintf(outfile, "#                gradient verify      %d \n",
+          gradient_verify);
   fprintf(outfile, "#                gamma_tik            %1.e \n", gamma_tik);
   fprintf(outfile, "#                gamma_ddt            %1.e \n", gamma_ddt);
   fprintf(outfile, "#                gamma_class          %1.e \n",
@@ -435,6 +753,10 @@ int Config::writeToFile(FILE *outfile) {
   fprintf(outfile, "#                gtol                 %1.e \n", gtol);
   fprintf(outfile, "#                max. ls iter         %d \n", ls_maxiter);
   fprintf(outfile, "#                ls factor            %f \n", ls_factor);
+  fprintf(outfile, "#                one-shot iter        %d \n",
+          optim_oneshot);
+  fprintf(outfile, "#                one-shot rtol        %1.e \n",
+          optim_oneshotrtol);
   fprintf(outfile, "#                weights_init         %f \n", weights_init);
   fprintf(outfile, "#                weights_open_init    %f \n",
           weights_open_init);
@@ -467,3 +789,10 @@ MyReal Config::getStepsize(int optimiter) {
 
   return stepsize;
 }
+
+MyReal Config::getBraidTol(int adjoint, MyReal gnorm) {
+  MyReal abstol = adjoint ? braid_abstoladj : braid_abstol;
+
+  if (!braid_inexact || gnorm < 0.0) return abstol;
+  return std::max(abstol, braid_inexactfactor * gnorm);
+}
@@ -32,12 +32,20 @@ DataSet::DataSet() {
 
   examples = NULL;
   labels = NULL;
+  exampledata = NULL;
+  labeldata = NULL;
+
+  nbatchglobal = 0;
+  batchoffset = 0;
+  nreplicas = 1;
+  ireplica = 0;
+  replicacomm = MPI_COMM_SELF;
   batchIDs = NULL;
   availIDs = NULL;
 }
 
 void DataSet::initialize(int nElements, int nFeatures, int nLabels, int nBatch,
-                         MPI_Comm comm) {
+                         MPI_Comm comm, ThreadPool *threads) {
   nelements = nElements;
   nfeatures = nFeatures;
   nlabels = nLabels;
@@ -49,19 +57,22 @@ void DataSet::initialize(int nElements, int nFeatures, int nLabels, int nBatch,
 
   /* Sanity check */
   if (nbatch > nelements) nbatch = nelements;
+  nbatchglobal = nbatch;
 
   /* Allocate feature vectors on first processor */
   if (MPIrank == 0) {
+    exampledata = threads->allocate(nelements, nfeatures);
     examples = new MyReal *[nelements];
     for (int ielem = 0; ielem < nelements; ielem++) {
-      examples[ielem] = new MyReal[nfeatures];
+      examples[ielem] = &(exampledata[ielem * nfeatures]);
     }
   }
   /* Allocate label vectors on last processor */
   if (MPIrank == MPIsize - 1) {
+    labeldata = threads->allocate(nelements, nlabels);
     labels = new MyReal *[nelements];
     for (int ielem = 0; ielem < nelements; ielem++) {
-      labels[ielem] = new MyReal[nlabels];
+      labels[ielem] = &(labeldata[ielem * nlabels]);
     }
   }
 
@@ -86,36 +97,58 @@ void DataSet::initialize(int nElements, int nFeatures, int nLabels, int nBatch,
 DataSet::~DataSet() {
   /* Deallocate feature vectors on first processor */
   if (examples != NULL) {
-    for (int ielem = 0; ielem < nelements; ielem++) {
-      delete[] examples[ielem];
-    }
     delete[] examples;
+    ThreadPool::deallocate(exampledata);
   }
 
   /* Deallocate label vectors on last processor */
   if (labels != NULL) {
-    for (int ielem = 0; ielem < nelements; ielem++) {
-      delete[] labels[ielem];
-    }
     delete[] labels;
+    ThreadPool::deallocate(labeldata);
   }
 
   if (availIDs != NULL) delete[] availIDs;
   if (batchIDs != NULL) delete[] batchIDs;
 }
 
+void DataSet::setReplicas(MPI_Comm ReplicaComm) {
+  replicacomm = ReplicaComm;
+  MPI_Comm_rank(replicacomm, &ireplica);
+  MPI_Comm_size(replicacomm, &nreplicas);
+
+  /* Contiguous shards of the batch positions */
+  batchoffset = (int)(((long)nbatchglobal * ireplica) / nreplicas);
+  nbatch = (int)(((long)nbatchglobal * (ireplica + 1)) / nreplicas) -
+           batchoffset;
+}
+
 int DataSet::getnBatch() { return nbatch; }
 
+MyReal DataSet::getReplicaWeight() {
+  return (MyReal)nbatch / (MyReal)nbatchglobal;
+}
+
+MyReal DataSet::reduceReplicas(MyReal value) {
+  MyReal sum = getReplicaWeight() * value;
+
+  if (nreplicas > 1) {
+    MPI_Allreduce(MPI_IN_PLACE, &sum, 1, MPI_MyReal, MPI_SUM, replicacomm);
+  }
+  return sum;
+}
+
+MPI_Comm DataSet::getReplicaComm() { return replicacomm; }
+
 MyReal *DataSet::getExample(int id) {
   if (examples == NULL) return NULL;
 
-  return examples[batchIDs[id]];
+  return examples[batchIDs[batchoffset + id]];
 }
 
 MyReal *DataSet::getLabel(int id) {
   if (labels == NULL) return NULL;
 
-  return labels[batchIDs[id]];
+  return labels[batchIDs[batchoffset + id]];
 }
 
 void DataSet::readData(const char *datafolder, const char *examplefile,
@@ -148,11 +181,12 @@ void DataSet::selectBatch(int batch_type, MPI_Comm comm) {
 
     case STOCHASTIC:
 
-      /* Randomly choose a batch on first processor, send to last processor */
-      if (MPIrank == 0) {
+      /* Randomly choose a batch on first processor of the first replica,
+       * send to last processor */
+      if (MPIrank == 0 && ireplica == 0) {
         /* Fill the batchID vector with randomly generated integer */
         rand_range = navail - 1;
-        for (int ibatch = 0; ibatch < nbatch; ibatch++) {
+        for (int ibatch = 0; ibatch < nbatchglobal; ibatch++) {
           /* Generate a new random index in [0,range] */
           irand = (int)((((double)rand()) / (double)RAND_MAX) * rand_range);
 
@@ -166,16 +200,24 @@ void DataSet::selectBatch(int batch_type, MPI_Comm comm) {
           availIDs[rand_range] = tmp;
           rand_range--;
         }
+      }
+
+      /* Share the batch with the first processors of the other replicas */
+      if (MPIrank == 0 && nreplicas > 1) {
+        MPI_Bcast(batchIDs, nbatchglobal, MPI_INT, 0, replicacomm);
+      }
 
-        /* Send to the last processor */
+      /* Send to the last processor */
+      if (MPIrank == 0) {
         int receiver = MPIsize - 1;
-        MPI_Isend(batchIDs, nbatch, MPI_INT, receiver, 0, comm, &sendreq);
+        MPI_Isend(batchIDs, nbatchglobal, MPI_INT, receiver, 0, comm,
+                  &sendreq);
       }
 
       /* Receive the batch IDs on last processor */
       if (MPIrank == MPIsize - 1) {
         int source = 0;
-        MPI_Irecv(batchIDs, nbatch, MPI_INT, source, 0, comm, &recvreq);
+        MPI_Irecv(batchIDs, nbatchglobal, MPI_INT, source, 0, comm, &recvreq);
       }
 
       /* Wait to finish communication */
@@ -191,7 +233,7 @@ void DataSet::printBatch() {
   {
     printf("%d:\n", MPIrank);
     for (int ibatch = 0; ibatch < nbatch; ibatch++) {
-      printf("%d, %04d\n", ibatch, batchIDs[ibatch]);
+      printf("%d, %04d\n", ibatch, batchIDs[batchoffset + ibatch]);
     }
   }
 }
@@ -0,0 +1,161 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "ftasks.hpp"
+
+FIntervalTasks::FIntervalTasks(Network *Network, int nBatch, int nChannels,
+                               int cFactor, int nTime, MyReal finalT) {
+  network = Network;
+  nbatch = nBatch;
+  nchannels = nChannels;
+  cfactor = cFactor > 1 ? cFactor : 1;
+  ntime = nTime;
+  T = finalT;
+
+  ilower = 0;
+  iupper = -1;
+  nsteps = 0;
+  input = NULL;
+  output = NULL;
+  valid = NULL;
+  layers = NULL;
+  dts = NULL;
+  version = -1;
+}
+
+FIntervalTasks::~FIntervalTasks() { deallocate(); }
+
+void FIntervalTasks::allocate(int Ilower, int Iupper) {
+  deallocate();
+
+  ilower = Ilower;
+  iupper = Iupper;
+  nsteps = iupper - ilower;
+  if (nsteps < 0) nsteps = 0;
+
+  /* The states are allocated when the intervals are first computed */
+  input = new MyReal *[nsteps];
+  output = new MyReal *[nsteps];
+  valid = new int[nsteps];
+  layers = new Layer *[nsteps];
+  dts = new MyReal[nsteps];
+  for (int k = 0; k < nsteps; k++) {
+    input[k] = NULL;
+    output[k] = NULL;
+    valid[k] = 0;
+    layers[k] = NULL;
+    dts[k] = 0.0;
+  }
+}
+
+void FIntervalTasks::deallocate() {
+  for (int k = 0; k < nsteps; k++) {
+    /* Outputs inside of an interval are owned by the next step's input */
+    int ts = ilower + k;
+    int cpoint = ((ts + 1) % cfactor == 0) || k == nsteps - 1;
+    if (cpoint) delete[] output[k];
+    delete[] input[k];
+  }
+  delete[] input;
+  delete[] output;
+  delete[] valid;
+  delete[] layers;
+  delete[] dts;
+  input = NULL;
+  output = NULL;
+  valid = NULL;
+  layers = NULL;
+  dts = NULL;
+  nsteps = 0;
+}
+
+int FIntervalTasks::getCFactor() { return cfactor; }
+
+int FIntervalTasks::getFirstCPoint(int Ilower) {
+  return (Ilower + cfactor - 1) / cfactor * cfactor;
+}
+
+int FIntervalTasks::getnIntervals(int Ilower, int Iupper) {
+  int first = getFirstCPoint(Ilower);
+  if (first >= Iupper) return 0;
+  return (Iupper - 1 - first) / cfactor + 1;
+}
+
+void FIntervalTasks::launch(int Ilower, int Iupper, MyReal **cstates) {
+  int size = nbatch * nchannels;
+  int first = getFirstCPoint(Ilower);
+  int nintervals = getnIntervals(Ilower, Iupper);
+
+  if (Ilower != ilower || Iupper != iupper) allocate(Ilower, Iupper);
+  version = network->getDesignVersion();
+
+  /* Set up the steps of the intervals on this thread. This is where the
+   * layers are taken from the network, the tasks don't call into it. */
+  int kstart = std::max(first - ilower, 0);
+  for (int k = kstart; k < nsteps; k++) {
+    int ts = ilower + k;
+    int cpoint = ((ts + 1) % cfactor == 0) || k == nsteps - 1;
+    if (input[k] == NULL) input[k] = new MyReal[size];
+    if (output[k] == NULL) output[k] = cpoint ? new MyReal[size] : NULL;
+    valid[k] = 0;
+    layers[k] = network->getLayer(ts);
+    /* Same time step size as braid on the fine grid */
+    dts[k] = ((ts + 1) / (MyReal)ntime) * T - (ts / (MyReal)ntime) * T;
+  }
+  for (int k = kstart; k < nsteps - 1; k++) {
+    int ts = ilower + k;
+    if ((ts + 1) % cfactor != 0) output[k] = input[k + 1];
+  }
+
+  /* Compute the intervals in parallel */
+  network->getThreadPool()->runTasks(nintervals, [&](int i) {
+    if (cstates[i] == NULL) return;
+
+    int cpoint = first + i * cfactor;
+    int kfirst = cpoint - ilower;
+    int klast = std::min(cpoint + cfactor, iupper) - 1 - ilower;
+
+    memcpy(input[kfirst], cstates[i], size * sizeof(MyReal));
+    for (int k = kfirst; k <= klast; k++) {
+      memcpy(output[k], input[k], size * sizeof(MyReal));
+      layers[k]->setDt(dts[k]);
+      for (int iex = 0; iex < nbatch; iex++) {
+        layers[k]->applyFWD(&(output[k][iex * nchannels]));
+      }
+      valid[k] = 1;
+    }
+  });
+}
+
+int FIntervalTasks::apply(int ts, Layer *layer, MyReal dt, MyReal *state) {
+  int k = ts - ilower;
+
+  /* Check that the step has been computed from the same input */
+  if (k < 0 || k >= nsteps || !valid[k]) return 0;
+  if (version != network->getDesignVersion()) return 0;
+  if (layers[k] != layer || dts[k] != dt) return 0;
+  if (memcmp(input[k], state, nbatch * nchannels * sizeof(MyReal)) != 0) {
+    return 0;
+  }
+
+  memcpy(state, output[k], nbatch * nchannels * sizeof(MyReal));
+  return 1;
+}
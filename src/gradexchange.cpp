@@ -0,0 +1,225 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "gradexchange.hpp"
+
+GradientExchange::GradientExchange(DataSet *Data, Network *Network,
+                                   Config *config) {
+  data = Data;
+  network = Network;
+  bucketsize = config->gradient_bucketsize;
+  compress = config->gradient_compress;
+  topk = config->gradient_topk;
+  verify = config->gradient_verify && compress != GRADCOMPRESS_NONE;
+  nstarted = 0;
+  active = 0;
+  waittime = 0.0;
+  relerror = 0.0;
+  exactnorm = 0.0;
+}
+
+GradientExchange::~GradientExchange() {
+  wait();
+  for (size_t i = 0; i < buckets.size(); i++) {
+    delete[] buckets[i].sendbuf;
+    delete[] buckets[i].recvbuf;
+    delete[] buckets[i].residual;
+    delete[] buckets[i].exact;
+  }
+}
+
+void GradientExchange::compressBucket(Bucket *bucket) {
+  int count = bucket->count;
+  MyReal *values = bucket->values;
+  MyReal *residual = bucket->residual;
+
+  /* Error feedback */
+  for (int i = 0; i < count; i++) {
+    residual[i] += values[i];
+  }
+
+  if (compress == GRADCOMPRESS_TOPK) {
+    /* Send the k largest entries as index/value pairs, ties are broken by
+     * the index */
+    int k = (bucket->nbytes) / (sizeof(int) + sizeof(MyReal));
+    MyReal *value = (MyReal *)bucket->sendbuf;
+    int *index = (int *)(bucket->sendbuf + k * sizeof(MyReal));
+    std::vector<int> order(count);
+    for (int i = 0; i < count; i++) order[i] = i;
+    std::nth_element(order.begin(), order.begin() + (k - 1), order.end(),
+                     [&](int a, int b) {
+                       MyReal fa = fabs(residual[a]);
+                       MyReal fb = fabs(residual[b]);
+                       return fa > fb || (fa == fb && a < b);
+                     });
+    for (int j = 0; j < k; j++) {
+      index[j] = order[j];
+      value[j] = residual[order[j]];
+      residual[order[j]] = 0.0;
+    }
+  } else {
+    /* Round, the rounding error is the new residual */
+    int type = compress == GRADCOMPRESS_FP32 ? COMPRESS_FP32 : COMPRESS_BF16;
+    compressState(type, 0.0, count, residual, bucket->sendbuf, NULL);
+    decompressState(type, count, bucket->sendbuf, values, NULL);
+    for (int i = 0; i < count; i++) {
+      residual[i] -= values[i];
+    }
+  }
+}
+
+void GradientExchange::addBucket(Bucket *bucket, char *buffer) {
+  int count = bucket->count;
+  MyReal *values = bucket->values;
+
+  if (compress == GRADCOMPRESS_TOPK) {
+    int k = (bucket->nbytes) / (sizeof(int) + sizeof(MyReal));
+    MyReal *value = (MyReal *)buffer;
+    int *index = (int *)(buffer + k * sizeof(MyReal));
+    for (int j = 0; j < k; j++) {
+      values[index[j]] += value[j];
+    }
+  } else {
+    int type = compress == GRADCOMPRESS_FP32 ? COMPRESS_FP32 : COMPRESS_BF16;
+    std::vector<MyReal> decoded(count);
+    decompressState(type, count, buffer, decoded.data(), NULL);
+    for (int i = 0; i < count; i++) {
+      values[i] += decoded[i];
+    }
+  }
+}
+
+void GradientExchange::start(int n, MyReal *values) {
+  MPI_Comm comm = data->getReplicaComm();
+  int nreplicas;
+
+  MPI_Comm_size(comm, &nreplicas);
+  if (nreplicas == 1) return;
+  active = 1;
+  if (n <= 0) return;
+
+  /* Weight with this replica's share of the batch */
+  MyReal weight = data->getReplicaWeight();
+  for (int i = 0; i < n; i++) {
+    values[i] *= weight;
+  }
+
+  /* Start the exchange of each bucket */
+  int size = bucketsize > 0 ? bucketsize : n;
+  for (int first = 0; first < n; first += size) {
+    MPI_Request request;
+    int count = std::min(size, n - first);
+
+    if (compress == GRADCOMPRESS_NONE) {
+      MPI_Iallreduce(MPI_IN_PLACE, &(values[first]), count, MPI_MyReal,
+                     MPI_SUM, comm, &request);
+      requests.push_back(request);
+      continue;
+    }
+
+    /* Set up the bucket in its first exchange */
+    if (nstarted == (int)buckets.size()) {
+      Bucket bucket;
+      bucket.count = count;
+      if (compress == GRADCOMPRESS_TOPK) {
+        int k = std::max(1, std::min(count, (int)(topk * count)));
+        bucket.nbytes = k * (sizeof(int) + sizeof(MyReal));
+      } else {
+        int type =
+            compress == GRADCOMPRESS_FP32 ? COMPRESS_FP32 : COMPRESS_BF16;
+        bucket.nbytes = compressBound(type, count);
+      }
+      bucket.sendbuf = new char[bucket.nbytes];
+      bucket.recvbuf = new char[nreplicas * bucket.nbytes];
+      bucket.residual = new MyReal[count];
+      for (int i = 0; i < count; i++) bucket.residual[i] = 0.0;
+      bucket.exact = verify ? new MyReal[count] : NULL;
+      buckets.push_back(bucket);
+    }
+    Bucket *bucket = &(buckets[nstarted]);
+    if (bucket->count != count) {
+      printf("\n\n ERROR: Gradient buckets differ between exchanges!\n\n");
+      exit(1);
+    }
+    bucket->values = &(values[first]);
+    nstarted++;
+
+    /* Exact average for the verification */
+    if (verify) {
+      memcpy(bucket->exact, bucket->values, count * sizeof(MyReal));
+      MPI_Iallreduce(MPI_IN_PLACE, bucket->exact, count, MPI_MyReal, MPI_SUM,
+                     comm, &request);
+      requests.push_back(request);
+    }
+
+    compressBucket(bucket);
+    MPI_Iallgather(bucket->sendbuf, bucket->nbytes, MPI_BYTE, bucket->recvbuf,
+                   bucket->nbytes, MPI_BYTE, comm, &request);
+    requests.push_back(request);
+  }
+}
+
+void GradientExchange::wait() {
+  if (!active) return;
+  active = 0;
+
+  MyReal start = MPI_Wtime();
+  MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+  requests.clear();
+  waittime += MPI_Wtime() - start;
+
+  /* Sum the compressed buckets of all replicas in replica order */
+  int nreplicas;
+  MPI_Comm_size(data->getReplicaComm(), &nreplicas);
+  MyReal norms[2] = {0.0, 0.0};
+  for (int ib = 0; ib < nstarted; ib++) {
+    Bucket *bucket = &(buckets[ib]);
+    for (int i = 0; i < bucket->count; i++) bucket->values[i] = 0.0;
+    for (int r = 0; r < nreplicas; r++) {
+      addBucket(bucket, bucket->recvbuf + r * bucket->nbytes);
+    }
+
+    if (verify) {
+      for (int i = 0; i < bucket->count; i++) {
+        MyReal diff = bucket->values[i] - bucket->exact[i];
+        norms[0] += diff * diff;
+        norms[1] += bucket->exact[i] * bucket->exact[i];
+      }
+    }
+  }
+  nstarted = 0;
+
+  /* Compare with the exact gradient of all layers */
+  if (verify) {
+    MPI_Allreduce(MPI_IN_PLACE, norms, 2, MPI_MyReal, MPI_SUM,
+                  network->getComm());
+    exactnorm = sqrt(norms[1]);
+    relerror = exactnorm > 0.0 ? sqrt(norms[0]) / exactnorm : 0.0;
+  }
+}
+
+MyReal GradientExchange::getWaitTime() { return waittime; }
+
+void GradientExchange::getVerification(MyReal *relerror_ptr,
+                                       MyReal *exactnorm_ptr) {
+  *relerror_ptr = relerror;
+  *exactnorm_ptr = exactnorm;
+}
@@ -22,6 +22,7 @@
 #include "layer.hpp"
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
 #include <iostream>
 
@@ -43,8 +44,19 @@ Layer::Layer() {
   bias_bar = NULL;
   gamma_tik = 0.0;
   gamma_ddt = 0.0;
-  update = NULL;
-  update_bar = NULL;
+  nthreads = 1;
+  update_threads = NULL;
+  update_bar_threads = NULL;
+  bar_threads = NULL;
+
+  tensorcomm = MPI_COMM_NULL;
+  ntensor = 1;
+  itensor = 0;
+  tensorunit = 1;
+  tensorfirst = 0;
+  tensorlast = 0;
+  tensorbuf = NULL;
+  tensorbufsize = 0;
 }
 
 Layer::Layer(int idx, int Type, int dimI, int dimO, int dimB, int dimW,
@@ -62,17 +74,57 @@ Layer::Layer(int idx, int Type, int dimI, int dimO, int dimB, int dimW,
   gamma_tik = gammatik;
   gamma_ddt = gammaddt;
 
-  update = new MyReal[dimO];
-  update_bar = new MyReal[dimO];
+  update_threads = new MyReal[dimO];
+  update_bar_threads = new MyReal[dimO];
+
+  tensorlast = dimO;
 }
 
 Layer::~Layer() {
-  delete[] update;
-  delete[] update_bar;
+  delete[] update_threads;
+  delete[] update_bar_threads;
+  delete[] bar_threads;
+  delete[] tensorbuf;
 }
 
 void Layer::setDt(MyReal DT) { dt = DT; }
 
+void Layer::setnThreads(int nThreads) {
+  nthreads = nThreads;
+
+  delete[] update_threads;
+  delete[] update_bar_threads;
+  update_threads = new MyReal[nthreads * dim_Out];
+  update_bar_threads = new MyReal[nthreads * dim_Out];
+
+  delete[] bar_threads;
+  bar_threads = NULL;
+  if (nthreads > 1) {
+    bar_threads = new MyReal[(nthreads - 1) * ndesign];
+    for (int i = 0; i < (nthreads - 1) * ndesign; i++) bar_threads[i] = 0.0;
+  }
+}
+
+MyReal *Layer::getUpdate() {
+  return update_threads + ThreadPool::getThreadID() * dim_Out;
+}
+
+MyReal *Layer::getUpdateBar() {
+  return update_bar_threads + ThreadPool::getThreadID() * dim_Out;
+}
+
+MyReal *Layer::getThreadWeightsBar() {
+  int tid = ThreadPool::getThreadID();
+  if (tid == 0) return weights_bar;
+  return bar_threads + (tid - 1) * ndesign;
+}
+
+MyReal *Layer::getThreadBiasBar() {
+  int tid = ThreadPool::getThreadID();
+  if (tid == 0) return bias_bar;
+  return bar_threads + (tid - 1) * ndesign + nweights;
+}
+
 MyReal Layer::getDt() { return dt; }
 
 void Layer::setMemory(MyReal *design_memloc, MyReal *gradient_memloc) {
@@ -85,6 +137,89 @@ void Layer::setMemory(MyReal *design_memloc, MyReal *gradient_memloc) {
   bias_bar = gradient_memloc + nweights;
 }
 
+void Layer::setTensorComm(MPI_Comm comm) {
+  tensorcomm = comm;
+  MPI_Comm_size(tensorcomm, &ntensor);
+  MPI_Comm_rank(tensorcomm, &itensor);
+  getTensorSlices(itensor, &tensorfirst, &tensorlast);
+}
+
+int Layer::getnTensor() { return ntensor; }
+
+void Layer::getTensorSlices(int rank, int *first, int *last) {
+  int nslices = dim_Out / tensorunit;
+  *first = (int)(((long)nslices * rank) / ntensor);
+  *last = (int)(((long)nslices * (rank + 1)) / ntensor);
+}
+
+void Layer::gatherTensorSlices(int nbatch, MyReal *states) {
+  if (ntensor == 1) return;
+
+  /* Sizes of the slices of all processors */
+  int *counts = new int[ntensor];
+  int *displs = new int[ntensor];
+  int *firsts = new int[ntensor];
+  int total = 0;
+  for (int rank = 0; rank < ntensor; rank++) {
+    int first, last;
+    getTensorSlices(rank, &first, &last);
+    firsts[rank] = first * tensorunit;
+    counts[rank] = nbatch * (last - first) * tensorunit;
+    displs[rank] = total;
+    total += counts[rank];
+  }
+
+  if (tensorbufsize < total + counts[itensor]) {
+    delete[] tensorbuf;
+    tensorbufsize = total + counts[itensor];
+    tensorbuf = new MyReal[tensorbufsize];
+  }
+  MyReal *sendbuf = tensorbuf + total;
+
+  /* Pack the own slices of all examples, exchange and unpack */
+  int nown = counts[itensor] / nbatch;
+  for (int iex = 0; iex < nbatch; iex++) {
+    memcpy(&(sendbuf[iex * nown]),
+           &(states[iex * dim_Out + firsts[itensor]]), nown * sizeof(MyReal));
+  }
+  MPI_Allgatherv(sendbuf, counts[itensor], MPI_MyReal, tensorbuf, counts,
+                 displs, MPI_MyReal, tensorcomm);
+  for (int rank = 0; rank < ntensor; rank++) {
+    int n = counts[rank] / nbatch;
+    if (rank == itensor || n == 0) continue;
+    for (int iex = 0; iex < nbatch; iex++) {
+      memcpy(&(states[iex * dim_Out + firsts[rank]]),
+             &(tensorbuf[displs[rank] + iex * n]), n * sizeof(MyReal));
+    }
+  }
+
+  delete[] counts;
+  delete[] displs;
+  delete[] firsts;
+}
+
+void Layer::clearOtherTensorSlices(MyReal *state) {
+  if (ntensor == 1) return;
+
+  for (int i = 0; i < tensorfirst * tensorunit; i++) state[i] = 0.0;
+  for (int i = tensorlast * tensorunit; i < dim_In; i++) state[i] = 0.0;
+}
+
+void Layer::sumTensorSlices(int nbatch, MyReal *states) {
+  if (ntensor == 1) return;
+
+  MPI_Allreduce(MPI_IN_PLACE, states, nbatch * dim_In, MPI_MyReal, MPI_SUM,
+                tensorcomm);
+}
+
+void Layer::reduceTensorGradient() {
+  if (ntensor == 1) return;
+
+  /* Weights and bias are stored contiguously */
+  MPI_Allreduce(MPI_IN_PLACE, weights_bar, ndesign, MPI_MyReal, MPI_SUM,
+                tensorcomm);
+}
+
 MyReal Layer::getGammaTik() { return gamma_tik; }
 
 MyReal Layer::getGammaDDT() { return gamma_ddt; }
@@ -108,6 +243,13 @@ int Layer::getnDesign() { return ndesign; }
 int Layer::getnConv() { return nconv; }
 int Layer::getCSize() { return csize; }
 
+MyReal Layer::getCost() {
+  /* Convolutions apply their kernels at each pixel of the images, layers
+   * without weights copy their outputs */
+  if (type == CONVOLUTION) return (MyReal)nweights * (dim_In / nconv);
+  return (MyReal)std::max(nweights, dim_Out);
+}
+
 int Layer::getIndex() { return index; }
 
 void Layer::print_data(MyReal *data) {
@@ -216,6 +358,20 @@ void Layer::resetBar() {
   }
 }
 
+void Layer::reduceBar() {
+  for (int tid = 1; tid < nthreads; tid++) {
+    MyReal *bar = bar_threads + (tid - 1) * ndesign;
+    for (int i = 0; i < nweights; i++) {
+      weights_bar[i] += bar[i];
+      bar[i] = 0.0;
+    }
+    for (int i = 0; i < dim_Bias; i++) {
+      bias_bar[i] += bar[nweights + i];
+      bar[nweights + i] = 0.0;
+    }
+  }
+}
+
 MyReal Layer::evalTikh() {
   MyReal tik = 0.0;
   for (int i = 0; i < nweights; i++) {
@@ -319,8 +475,10 @@ DenseLayer::DenseLayer(int idx, int dimI, int dimO, MyReal deltaT, int Activ,
 DenseLayer::~DenseLayer() {}
 
 void DenseLayer::applyFWD(MyReal *state) {
-  /* Affine transformation */
-  for (int io = 0; io < dim_Out; io++) {
+  MyReal *update = getUpdate();
+
+  /* Affine transformation (of this processor's outputs) */
+  for (int io = tensorfirst; io < tensorlast; io++) {
     /* Apply weights */
     update[io] = vecdot(dim_In, &(weights[io * dim_In]), state);
 
@@ -329,7 +487,7 @@ void DenseLayer::applyFWD(MyReal *state) {
   }
 
   /* Apply step */
-  for (int io = 0; io < dim_Out; io++) {
+  for (int io = tensorfirst; io < tensorlast; io++) {
     state[io] = state[io] + dt * activation(update[io]);
   }
 }
@@ -339,9 +497,13 @@ void DenseLayer::applyBWD(MyReal *state, MyReal *state_bar,
   /* state_bar is the adjoint of the state variable, it contains the
      old time adjoint informationk, and is modified on the way out to
      contain the update. */
+  MyReal *update = getUpdate();
+  MyReal *update_bar = getUpdateBar();
+  MyReal *wbar = getThreadWeightsBar();
+  MyReal *bbar = getThreadBiasBar();
 
-  /* Derivative of the step */
-  for (int io = 0; io < dim_Out; io++) {
+  /* Derivative of the step (of this processor's outputs) */
+  for (int io = tensorfirst; io < tensorlast; io++) {
     /* Recompute affine transformation */
     update[io] = vecdot(dim_In, &(weights[io * dim_In]), state);
     update[io] += bias[0];
@@ -350,31 +512,200 @@ void DenseLayer::applyBWD(MyReal *state, MyReal *state_bar,
     update_bar[io] = dt * dactivation(update[io]) * state_bar[io];
   }
 
-  /* Derivative of linear transformation */
-  for (int io = 0; io < dim_Out; io++) {
+  /* The other processors add the old adjoint of their slices */
+  clearOtherTensorSlices(state_bar);
+
+  /* Derivative of linear transformation (dim_In = dim_Out) */
+  for (int io = tensorfirst; io < tensorlast; io++) {
     /* Derivative of bias addition */
-    if (compute_gradient) bias_bar[0] += update_bar[io];
+    if (compute_gradient) bbar[0] += update_bar[io];
 
     /* Derivative of weight application */
     for (int ii = 0; ii < dim_In; ii++) {
       if (compute_gradient)
-        weights_bar[io * dim_In + ii] += state[ii] * update_bar[io];
+        wbar[io * dim_In + ii] += state[ii] * update_bar[io];
       state_bar[ii] += weights[io * dim_In + ii] * update_bar[io];
     }
   }
 }
 
+LowRankLayer::LowRankLayer(int idx, int dim, int Rank, MyReal deltaT,
+                           int Activ)
+    : Layer(idx, LOWRANK, dim, dim, 1,
+            2 * dim * std::min(std::max(Rank, 1), dim), deltaT, Activ, 0.0,
+            0.0) {
+  rank = std::min(std::max(Rank, 1), dim);
+  rank_threads = new MyReal[2 * rank];
+}
+
+LowRankLayer::~LowRankLayer() { delete[] rank_threads; }
+
+void LowRankLayer::setnThreads(int nThreads) {
+  Layer::setnThreads(nThreads);
+  delete[] rank_threads;
+  rank_threads = new MyReal[nthreads * 2 * rank];
+}
+
+MyReal *LowRankLayer::getRankAux() {
+  return rank_threads + ThreadPool::getThreadID() * 2 * rank;
+}
+
+int LowRankLayer::getRank() { return rank; }
+
+void LowRankLayer::approximate(MyReal *W, MyReal b, int niter) {
+  int n = dim_In;
+  MyReal *U = weights;
+  MyReal *V = weights + n * rank;
+  MyReal *Z = new MyReal[n * rank];
+
+  /* Pseudo-random start basis with a fixed seed, so that all processors get
+   * the same approximation */
+  unsigned int seed = 12345;
+  for (int i = 0; i < n * rank; i++) {
+    seed = seed * 1103515245 + 12345;
+    U[i] = ((seed >> 16) & 0x7fff) / 32768.0 - 0.5;
+  }
+
+  for (int iter = 0; iter <= niter; iter++) {
+    /* Orthonormalize the columns of U (modified Gram-Schmidt) */
+    for (int k = 0; k < rank; k++) {
+      for (int l = 0; l < k; l++) {
+        MyReal dot = 0.0;
+        for (int i = 0; i < n; i++) dot += U[i * rank + k] * U[i * rank + l];
+        for (int i = 0; i < n; i++) U[i * rank + k] -= dot * U[i * rank + l];
+      }
+      MyReal norm = 0.0;
+      for (int i = 0; i < n; i++) norm += U[i * rank + k] * U[i * rank + k];
+      norm = sqrt(norm);
+      for (int i = 0; i < n; i++) {
+        U[i * rank + k] = norm > 1e-14 ? U[i * rank + k] / norm : 0.0;
+      }
+    }
+    if (iter == niter) break;
+
+    /* U = W W^T U */
+    for (int j = 0; j < n; j++) {
+      for (int k = 0; k < rank; k++) {
+        Z[j * rank + k] = 0.0;
+        for (int i = 0; i < n; i++) {
+          Z[j * rank + k] += W[i * n + j] * U[i * rank + k];
+        }
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      for (int k = 0; k < rank; k++) {
+        U[i * rank + k] = 0.0;
+        for (int j = 0; j < n; j++) {
+          U[i * rank + k] += W[i * n + j] * Z[j * rank + k];
+        }
+      }
+    }
+  }
+
+  /* V = W^T U, so that U V^T = U U^T W */
+  for (int j = 0; j < n; j++) {
+    for (int k = 0; k < rank; k++) {
+      V[j * rank + k] = 0.0;
+      for (int i = 0; i < n; i++) {
+        V[j * rank + k] += W[i * n + j] * U[i * rank + k];
+      }
+    }
+  }
+  bias[0] = b;
+
+  delete[] Z;
+}
+
+void LowRankLayer::applyFWD(MyReal *state) {
+  MyReal *update = getUpdate();
+  MyReal *z = getRankAux();
+  MyReal *U = weights;
+  MyReal *V = weights + dim_In * rank;
+
+  /* z = V^T y */
+  for (int k = 0; k < rank; k++) z[k] = 0.0;
+  for (int ii = 0; ii < dim_In; ii++) {
+    for (int k = 0; k < rank; k++) z[k] += V[ii * rank + k] * state[ii];
+  }
+
+  /* Affine transformation U z + b */
+  for (int io = 0; io < dim_Out; io++) {
+    update[io] = vecdot(rank, &(U[io * rank]), z) + bias[0];
+  }
+
+  /* Apply step */
+  for (int io = 0; io < dim_Out; io++) {
+    state[io] = state[io] + dt * activation(update[io]);
+  }
+}
+
+void LowRankLayer::applyBWD(MyReal *state, MyReal *state_bar,
+                            int compute_gradient) {
+  MyReal *update = getUpdate();
+  MyReal *update_bar = getUpdateBar();
+  MyReal *z = getRankAux();
+  MyReal *z_bar = z + rank;
+  MyReal *U = weights;
+  MyReal *V = weights + dim_In * rank;
+  MyReal *wbar = getThreadWeightsBar();
+  MyReal *bbar = getThreadBiasBar();
+
+  /* Recompute z = V^T y */
+  for (int k = 0; k < rank; k++) {
+    z[k] = 0.0;
+    z_bar[k] = 0.0;
+  }
+  for (int ii = 0; ii < dim_In; ii++) {
+    for (int k = 0; k < rank; k++) z[k] += V[ii * rank + k] * state[ii];
+  }
+
+  /* Derivative of the step and of U z + b */
+  for (int io = 0; io < dim_Out; io++) {
+    update[io] = vecdot(rank, &(U[io * rank]), z) + bias[0];
+    update_bar[io] = dt * dactivation(update[io]) * state_bar[io];
+
+    if (compute_gradient) bbar[0] += update_bar[io];
+    for (int k = 0; k < rank; k++) {
+      if (compute_gradient) wbar[io * rank + k] += z[k] * update_bar[io];
+      z_bar[k] += U[io * rank + k] * update_bar[io];
+    }
+  }
+
+  /* Derivative of V^T y */
+  for (int ii = 0; ii < dim_In; ii++) {
+    for (int k = 0; k < rank; k++) {
+      if (compute_gradient) {
+        wbar[dim_In * rank + ii * rank + k] += state[ii] * z_bar[k];
+      }
+      state_bar[ii] += V[ii * rank + k] * z_bar[k];
+    }
+  }
+}
+
 OpenDenseLayer::OpenDenseLayer(int dimI, int dimO, int Activ, MyReal gammatik)
     : DenseLayer(-1, dimI, dimO, 1.0, Activ, gammatik, 0.0) {
   type = OPENDENSE;
-  example = NULL;
+  examples = new MyReal *[1];
+  examples[0] = NULL;
 }
 
-OpenDenseLayer::~OpenDenseLayer() {}
+OpenDenseLayer::~OpenDenseLayer() { delete[] examples; }
 
-void OpenDenseLayer::setExample(MyReal *example_ptr) { example = example_ptr; }
+void OpenDenseLayer::setnThreads(int nThreads) {
+  DenseLayer::setnThreads(nThreads);
+  delete[] examples;
+  examples = new MyReal *[nthreads];
+  for (int i = 0; i < nthreads; i++) examples[i] = NULL;
+}
+
+void OpenDenseLayer::setExample(MyReal *example_ptr) {
+  examples[ThreadPool::getThreadID()] = example_ptr;
+}
 
 void OpenDenseLayer::applyFWD(MyReal *state) {
+  MyReal *update = getUpdate();
+  MyReal *example = examples[ThreadPool::getThreadID()];
+
   /* affine transformation */
   for (int io = 0; io < dim_Out; io++) {
     /* Apply weights */
@@ -392,6 +723,10 @@ void OpenDenseLayer::applyFWD(MyReal *state) {
 
 void OpenDenseLayer::applyBWD(MyReal *state, MyReal *state_bar,
                               int compute_gradient) {
+  MyReal *update = getUpdate();
+  MyReal *update_bar = getUpdateBar();
+  MyReal *example = examples[ThreadPool::getThreadID()];
+
   /* Derivative of step */
   for (int io = 0; io < dim_Out; io++) {
     /* Recompute affine transformation */
@@ -405,13 +740,15 @@ void OpenDenseLayer::applyBWD(MyReal *state, MyReal *state_bar,
 
   /* Derivative of affine transformation */
   if (compute_gradient) {
+    MyReal *wbar = getThreadWeightsBar();
+    MyReal *bbar = getThreadBiasBar();
     for (int io = 0; io < dim_Out; io++) {
       /* Derivative of bias addition */
-      bias_bar[0] += update_bar[io];
+      bbar[0] += update_bar[io];
 
       /* Derivative of weight application */
       for (int ii = 0; ii < dim_In; ii++) {
-        weights_bar[io * dim_In + ii] += example[ii] * update_bar[io];
+        wbar[io * dim_In + ii] += example[ii] * update_bar[io];
       }
     }
   }
@@ -422,13 +759,26 @@ OpenExpandZero::OpenExpandZero(int dimI, int dimO)
   /* this layer doesn't have any design variables. */
   ndesign = 0;
   nweights = 0;
+  examples = new MyReal *[1];
+  examples[0] = NULL;
 }
 
-OpenExpandZero::~OpenExpandZero() {}
+OpenExpandZero::~OpenExpandZero() { delete[] examples; }
+
+void OpenExpandZero::setnThreads(int nThreads) {
+  Layer::setnThreads(nThreads);
+  delete[] examples;
+  examples = new MyReal *[nthreads];
+  for (int i = 0; i < nthreads; i++) examples[i] = NULL;
+}
 
-void OpenExpandZero::setExample(MyReal *example_ptr) { example = example_ptr; }
+void OpenExpandZero::setExample(MyReal *example_ptr) {
+  examples[ThreadPool::getThreadID()] = example_ptr;
+}
 
 void OpenExpandZero::applyFWD(MyReal *state) {
+  MyReal *example = examples[ThreadPool::getThreadID()];
+
   for (int ii = 0; ii < dim_In; ii++) {
     state[ii] = example[ii];
   }
@@ -454,13 +804,27 @@ OpenConvLayer::OpenConvLayer(int dimI, int dimO)
   nconv = dim_Out / dim_In;
 
   assert(nconv * dim_In == dim_Out);
+
+  examples = new MyReal *[1];
+  examples[0] = NULL;
 }
 
-OpenConvLayer::~OpenConvLayer() {}
+OpenConvLayer::~OpenConvLayer() { delete[] examples; }
 
-void OpenConvLayer::setExample(MyReal *example_ptr) { example = example_ptr; }
+void OpenConvLayer::setnThreads(int nThreads) {
+  Layer::setnThreads(nThreads);
+  delete[] examples;
+  examples = new MyReal *[nthreads];
+  for (int i = 0; i < nthreads; i++) examples[i] = NULL;
+}
+
+void OpenConvLayer::setExample(MyReal *example_ptr) {
+  examples[ThreadPool::getThreadID()] = example_ptr;
+}
 
 void OpenConvLayer::applyFWD(MyReal *state) {
+  MyReal *example = examples[ThreadPool::getThreadID()];
+
   // replicate the image data
   for (int img = 0; img < nconv; img++) {
     for (int ii = 0; ii < dim_In; ii++) {
@@ -484,6 +848,8 @@ OpenConvLayerMNIST::OpenConvLayerMNIST(int dimI, int dimO)
 OpenConvLayerMNIST::~OpenConvLayerMNIST() {}
 
 void OpenConvLayerMNIST::applyFWD(MyReal *state) {
+  MyReal *example = examples[ThreadPool::getThreadID()];
+
   // replicate the image data
   for (int img = 0; img < nconv; img++) {
     for (int ii = 0; ii < dim_In; ii++) {
@@ -499,6 +865,8 @@ void OpenConvLayerMNIST::applyFWD(MyReal *state) {
 
 void OpenConvLayerMNIST::applyBWD(MyReal *state, MyReal *state_bar,
                                   int compute_gradient) {
+  MyReal *example = examples[ThreadPool::getThreadID()];
+
   // Derivative of step
   for (int img = 0; img < nconv; img++) {
     for (int ii = 0; ii < dim_In; ii++) {
@@ -519,13 +887,31 @@ ClassificationLayer::ClassificationLayer(int idx, int dimI, int dimO,
   gamma_tik = gammatik;
   /* Allocate the probability vector */
   probability = new MyReal[dimO];
+  labels = new MyReal *[1];
+  labels[0] = NULL;
 }
 
-ClassificationLayer::~ClassificationLayer() { delete[] probability; }
+ClassificationLayer::~ClassificationLayer() {
+  delete[] probability;
+  delete[] labels;
+}
 
-void ClassificationLayer::setLabel(MyReal *label_ptr) { label = label_ptr; }
+void ClassificationLayer::setnThreads(int nThreads) {
+  Layer::setnThreads(nThreads);
+  delete[] probability;
+  delete[] labels;
+  probability = new MyReal[nthreads * dim_Out];
+  labels = new MyReal *[nthreads];
+  for (int i = 0; i < nthreads; i++) labels[i] = NULL;
+}
+
+void ClassificationLayer::setLabel(MyReal *label_ptr) {
+  labels[ThreadPool::getThreadID()] = label_ptr;
+}
 
 void ClassificationLayer::applyFWD(MyReal *state) {
+  MyReal *update = getUpdate();
+
   /* Compute affine transformation */
   for (int io = 0; io < dim_Out; io++) {
     /* Apply weights */
@@ -556,6 +942,11 @@ void ClassificationLayer::applyFWD(MyReal *state) {
 
 void ClassificationLayer::applyBWD(MyReal *state, MyReal *state_bar,
                                    int compute_gradient) {
+  MyReal *update = getUpdate();
+  MyReal *update_bar = getUpdateBar();
+  MyReal *wbar = getThreadWeightsBar();
+  MyReal *bbar = getThreadBiasBar();
+
   /* Recompute affine transformation */
   for (int io = 0; io < dim_Out; io++) {
     update[io] = vecdot(dim_In, &(weights[io * dim_In]), state);
@@ -577,12 +968,12 @@ void ClassificationLayer::applyBWD(MyReal *state, MyReal *state_bar,
   /* Derivatie of affine transformation */
   for (int io = 0; io < dim_Out; io++) {
     /* Derivative of bias addition */
-    if (compute_gradient) bias_bar[io] += update_bar[io];
+    if (compute_gradient) bbar[io] += update_bar[io];
 
     /* Derivative of weight application */
     for (int ii = 0; ii < dim_In; ii++) {
       if (compute_gradient)
-        weights_bar[io * dim_In + ii] += state[ii] * update_bar[io];
+        wbar[io * dim_In + ii] += state[ii] * update_bar[io];
       state_bar[ii] += weights[io * dim_In + ii] * update_bar[io];
     }
   }
@@ -609,6 +1000,7 @@ void ClassificationLayer::normalize_diff(MyReal *data, MyReal *data_bar) {
 }
 
 MyReal ClassificationLayer::crossEntropy(MyReal *data_Out) {
+  MyReal *label = labels[ThreadPool::getThreadID()];
   MyReal label_pr, exp_sum;
   MyReal CELoss;
 
@@ -630,6 +1022,7 @@ MyReal ClassificationLayer::crossEntropy(MyReal *data_Out) {
 void ClassificationLayer::crossEntropy_diff(MyReal *data_Out,
                                             MyReal *data_Out_bar,
                                             MyReal loss_bar) {
+  MyReal *label = labels[ThreadPool::getThreadID()];
   MyReal exp_sum, exp_sum_bar;
   MyReal label_pr_bar = -loss_bar;
 
@@ -652,6 +1045,9 @@ void ClassificationLayer::crossEntropy_diff(MyReal *data_Out,
 }
 
 int ClassificationLayer::prediction(MyReal *data_Out, int *class_id_ptr) {
+  int tid = ThreadPool::getThreadID();
+  MyReal *label = labels[tid];
+  MyReal *prob = probability + tid * dim_Out;
   MyReal exp_sum, max;
   int class_id = -1;
   int success = 0;
@@ -665,11 +1061,11 @@ int ClassificationLayer::prediction(MyReal *data_Out, int *class_id_ptr) {
 
   for (int io = 0; io < dim_Out; io++) {
     /* Compute class probabilities (Softmax) */
-    probability[io] = exp(data_Out[io]) / exp_sum;
+    prob[io] = exp(data_Out[io]) / exp_sum;
 
     /* Predicted class is the one with maximum probability */
-    if (probability[io] > max) {
-      max = probability[io];
+    if (prob[io] > max) {
+      max = prob[io];
       class_id = io;
     }
   }
@@ -755,6 +1151,10 @@ ConvLayer::ConvLayer(int idx, int dimI, int dimO, int csize_in, int nconv_in,
   img_size = dim_In / nconv;
   img_size_sqrt = round(sqrt(img_size));
 
+  /* The output slices are the images of the convolutions */
+  tensorunit = img_size;
+  tensorlast = nconv;
+
   // nweights = csize*csize*nconv*nconv;
   // ndesign = nweights + dimI/nconv; // must add to account for the bias
 }
@@ -777,9 +1177,12 @@ ConvLayer::~ConvLayer() {}
  * state_bar carries withit all the information of the objective derivative.
  */
 MyReal ConvLayer::updateWeightDerivative(
-    MyReal *state, MyReal *update_bar, int output_conv, /* output convolution */
-    int j,                                              /* pixel index */
-    int k)                                              /* pixel index */
+    MyReal *state, MyReal *update_bar, MyReal *wbar,
+    int output_conv, /* output convolution */
+    int j,           /* pixel index */
+    int k,           /* pixel index */
+    int first,       /* first image of update_bar */
+    int last)        /* end of the images of update_bar */
 {
   MyReal val = 0;
 
@@ -803,8 +1206,9 @@ MyReal ConvLayer::updateWeightDerivative(
   const int fcsize_s = fcsize_s_u - fcsize_s_l;
   const int fcsize_t = fcsize_t_u - fcsize_t_l;
 
-  int center_index = j * img_size_sqrt + k;
-  int input_wght_idx = output_conv * csize2 * nconv + fcsize * (csize + 1);
+  int center_index = j * img_size_sqrt + k + first * img_size;
+  int input_wght_idx =
+      output_conv * csize2 * nconv + fcsize * (csize + 1) + first * csize2;
 
   int offset = fcsize_t_l + img_size_sqrt * fcsize_s_l;
   int wght_idx = fcsize_t_l + csize * fcsize_s_l;
@@ -812,12 +1216,12 @@ MyReal ConvLayer::updateWeightDerivative(
   int offset_adj = -fcsize_t_l_adj - img_size_sqrt * fcsize_s_l_adj;
   int wght_idx_adj = fcsize_t_l_adj + csize * fcsize_s_l_adj;
 
-  for (int input_image = 0; input_image < nconv;
+  for (int input_image = first; input_image < last;
        input_image++, center_index += img_size, input_wght_idx += csize2) {
     MyReal update_val = update_bar[center_index];
 
     MyReal *state_base = state + center_index + offset;
-    MyReal *weights_bar_base = weights_bar + input_wght_idx + wght_idx;
+    MyReal *weights_bar_base = wbar + input_wght_idx + wght_idx;
 
     MyReal *update_base = update_bar + center_index + offset_adj;
     MyReal *weights_base = weights + input_wght_idx + wght_idx_adj;
@@ -892,7 +1296,9 @@ MyReal ConvLayer::apply_conv(MyReal *state,
 MyReal ConvLayer::apply_conv_trans(MyReal *state,
                                    int output_conv, /* output convolution */
                                    int j,           /* pixel index */
-                                   int k)           /* pixel index */
+                                   int k,           /* pixel index */
+                                   int first,       /* first image of state */
+                                   int last) /* end of the images of state */
 {
   MyReal val = 0.0;
 
@@ -909,10 +1315,10 @@ MyReal ConvLayer::apply_conv_trans(MyReal *state,
   const int fcsize_s = fcsize_s_u - fcsize_s_l;
   const int fcsize_t = fcsize_t_u - fcsize_t_l;
 
-  /* loop over all the images */
-  int center_index = j * img_size_sqrt + k;
-  int input_wght_idx = output_conv * csize2 * nconv;
-  for (int input_image = 0; input_image < nconv;
+  /* loop over the images [first, last) */
+  int center_index = j * img_size_sqrt + k + first * img_size;
+  int input_wght_idx = output_conv * csize2 * nconv + first * csize2;
+  for (int input_image = first; input_image < last;
        input_image++, center_index += img_size, input_wght_idx += csize2) {
     int offset = center_index - fcsize_t_l;
     int wght_idx = input_wght_idx + fcsize * (csize + 1) + fcsize_t_l;
@@ -935,11 +1341,13 @@ MyReal ConvLayer::apply_conv_trans(MyReal *state,
 }
 
 void ConvLayer::applyFWD(MyReal *state) {
+  MyReal *update = getUpdate();
+
   /* Apply step */
   for (int io = 0; io < dim_Out; io++) update[io] = state[io];
 
-  /* Affine transformation */
-  for (int i = 0; i < nconv; i++) {
+  /* Affine transformation (of this processor's output convolutions) */
+  for (int i = tensorfirst; i < tensorlast; i++) {
     for (int j = 0; j < img_size_sqrt; j++) {
       int state_index = i * img_size + j * img_size_sqrt;
       MyReal *update_local = state + state_index;
@@ -997,11 +1405,15 @@ void ConvLayer::applyBWD(MyReal *state, MyReal *state_bar,
 
      computed below. Similar for the bias.
    */
+  MyReal *update_bar = getUpdateBar();
+  MyReal *wbar = getThreadWeightsBar();
+  MyReal *bbar = getThreadBiasBar();
 
-  /* Affine transformation, and derivative of time step */
+  /* Affine transformation, and derivative of time step (of this processor's
+   * output convolutions) */
 
   /* loop over number convolutions */
-  for (int i = 0; i < nconv; i++) {
+  for (int i = tensorfirst; i < tensorlast; i++) {
     /* loop over full image */
     for (int j = 0; j < img_size_sqrt; j++) {
       int state_index = i * img_size + j * img_size_sqrt;
@@ -1024,25 +1436,32 @@ void ConvLayer::applyBWD(MyReal *state, MyReal *state_bar,
     }
   }
 
-  /* Loop over the output dimensions */
+  /* The other processors add the old adjoint of their slices */
+  clearOtherTensorSlices(state_bar);
+
+  /* Loop over the output dimensions. The sums only run over this
+   * processor's images of update_bar. */
   for (int i = 0; i < nconv; i++) {
+    int own = (i >= tensorfirst && i < tensorlast);
+
     /* loop over full image */
     for (int j = 0; j < img_size_sqrt; j++) {
       int state_index = i * img_size + j * img_size_sqrt;
 
       MyReal *state_bar_local = state_bar + state_index;
       MyReal *update_bar_local = update_bar + state_index;
-      MyReal *bias_bar_local = bias_bar + j * img_size_sqrt;
+      MyReal *bias_bar_local = bbar + j * img_size_sqrt;
 
       for (int k = 0; k < img_size_sqrt;
            k++, state_bar_local++, update_bar_local++, bias_bar_local++) {
         if (compute_gradient) {
-          (*bias_bar_local) += (*update_bar_local);
+          if (own) (*bias_bar_local) += (*update_bar_local);
 
-          (*state_bar_local) +=
-              updateWeightDerivative(state, update_bar, i, j, k);
+          (*state_bar_local) += updateWeightDerivative(
+              state, update_bar, wbar, i, j, k, tensorfirst, tensorlast);
         } else {
-          (*state_bar_local) += apply_conv_trans(update_bar, i, j, k);
+          (*state_bar_local) +=
+              apply_conv_trans(update_bar, i, j, k, tensorfirst, tensorlast);
         }
       }
     }
@@ -0,0 +1,156 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "loadbalance.hpp"
+#include <algorithm>
+
+LoadBalance::LoadBalance(Network *Network, int Ilower, int Iupper,
+                         MPI_Comm Comm) {
+  network = Network;
+  comm = Comm;
+  npoints = network->getnLayersGlobal() - 1;
+  ilower = Ilower;
+  iupper = Iupper;
+  MPI_Comm_size(comm, &nblocks);
+
+  firsts.resize(nblocks + 1);
+  MPI_Allgather(&ilower, 1, MPI_INT, firsts.data(), 1, MPI_INT, comm);
+  firsts[nblocks] = npoints;
+}
+
+std::vector<int> LoadBalance::getWeightedBlocks(
+    const std::vector<MyReal> &costs, int nblocks) {
+  int npoints = costs.size();
+  std::vector<int> blocks(nblocks + 1, npoints);
+
+  /* Bisection for the smallest max. block cost that the greedy blocks
+   * reach with nblocks blocks */
+  MyReal lower = 0.0;
+  MyReal upper = 0.0;
+  for (int i = 0; i < npoints; i++) {
+    lower = std::max(lower, costs[i]);
+    upper += costs[i];
+  }
+  for (int iter = 0; iter < 100 && upper - lower > 1e-12 * upper; iter++) {
+    MyReal bound = 0.5 * (lower + upper);
+    int nused = 1;
+    MyReal sum = 0.0;
+    for (int i = 0; i < npoints; i++) {
+      if (sum + costs[i] > bound) {
+        nused++;
+        sum = 0.0;
+      }
+      sum += costs[i];
+    }
+    if (nused <= nblocks) {
+      upper = bound;
+    } else {
+      lower = bound;
+    }
+  }
+
+  /* Greedy blocks, leaving at least one point for each following block */
+  int i = 0;
+  for (int b = 0; b < nblocks; b++) {
+    blocks[b] = i;
+    MyReal sum = 0.0;
+    while (i < npoints - (nblocks - 1 - b)) {
+      if (i > blocks[b] && sum + costs[i] > upper) break;
+      sum += costs[i];
+      i++;
+    }
+  }
+
+  return blocks;
+}
+
+MyReal LoadBalance::getImbalance(const std::vector<MyReal> &costs,
+                                 const std::vector<int> &Firsts) {
+  MyReal total = 0.0;
+  MyReal maxcost = 0.0;
+
+  for (int b = 0; b < nblocks; b++) {
+    MyReal cost = 0.0;
+    for (int i = Firsts[b]; i < Firsts[b + 1]; i++) cost += costs[i];
+    total += cost;
+    maxcost = std::max(maxcost, cost);
+  }
+  if (total <= 0.0) return 1.0;
+
+  return maxcost * nblocks / total;
+}
+
+std::vector<MyReal> LoadBalance::getModelCosts() {
+  std::vector<MyReal> mycosts(npoints, 0.0);
+  std::vector<MyReal> costs(npoints, 0.0);
+
+  /* The steps from the own points apply the own layers, the layer at the
+   * last point is the classification */
+  for (int i = ilower; i <= iupper; i++) {
+    mycosts[i] = network->getLayer(i)->getCost();
+  }
+  if (ilower == 0) mycosts[0] += network->getLayer(-1)->getCost();
+  MPI_Allreduce(mycosts.data(), costs.data(), npoints, MPI_MyReal, MPI_SUM,
+                comm);
+
+  return costs;
+}
+
+std::vector<MyReal> LoadBalance::getMeasuredCosts(myBraidApp *primalapp,
+                                                  myBraidApp *adjointapp) {
+  std::vector<MyReal> mycosts(npoints, 0.0);
+  std::vector<MyReal> costs(npoints, 0.0);
+  std::vector<MyReal> &primaltime = primalapp->getPointTimes();
+  std::vector<MyReal> &adjointtime = adjointapp->getPointTimes();
+
+  for (int i = 0; i < npoints; i++) {
+    mycosts[i] = primaltime[i] + adjointtime[i];
+  }
+  MPI_Allreduce(mycosts.data(), costs.data(), npoints, MPI_MyReal, MPI_SUM,
+                comm);
+
+  return costs;
+}
+
+void LoadBalance::writeBlocks(FILE *outfile, const char *name,
+                              const std::vector<MyReal> &costs) {
+  std::vector<int> weighted = getWeightedBlocks(costs, nblocks);
+
+  fprintf(outfile, "   %-8s %.4f with braid's blocks, %.4f weighted\n",
+          name, getImbalance(costs, firsts), getImbalance(costs, weighted));
+  fprintf(outfile, "     weighted first points:");
+  for (int b = 0; b < nblocks; b++) fprintf(outfile, " %d", weighted[b]);
+  fprintf(outfile, "\n");
+}
+
+void LoadBalance::writeReport(FILE *outfile, myBraidApp *primalapp,
+                              myBraidApp *adjointapp) {
+  int rank;
+  std::vector<MyReal> measured = getMeasuredCosts(primalapp, adjointapp);
+  std::vector<MyReal> model = getModelCosts();
+
+  MPI_Comm_rank(comm, &rank);
+  if (rank != 0 || outfile == NULL) return;
+
+  fprintf(outfile, " Load balance (max. / mean cost of the processors):\n");
+  writeBlocks(outfile, "measured", measured);
+  writeBlocks(outfile, "model", model);
+}
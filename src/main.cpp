@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <algorithm>
 
 #include "braid_wrapper.hpp"
 #include "config.hpp"
@@ -31,6 +32,7 @@
 #include "defs.hpp"
 #include "hessianApprox.hpp"
 #include "layer.hpp"
+#include "loadbalance.hpp"
 #include "network.hpp"
 #include "util.hpp"
 
@@ -76,17 +78,37 @@ int main(int argc, char *argv[]) {
   MyReal ls_stepsize;
   MyReal ls_objective, test_obj;
   int ls_iter;
+  MyReal oneshotscale;     /**< Stepsize factor of the one-shot iteration */
+  MyReal oneshotobjective; /**< Objective at the last one-shot update */
 
   /* --- other --- */
   // TODO: What is this? Why do you need it?
   int myid;
   int size;
+  int provided;
+  int nreplicaranks;    /**< Number of processors of one replica */
+  int ntensor;          /**< Number of processors sharing a layer */
+  MPI_Comm layercomm;   /**< Layer-parallel processors of this replica */
+  MPI_Comm replicacomm; /**< Processors holding the same layers in all
+                             replicas */
+  MPI_Comm tensorcomm;  /**< Processors sharing the same layers */
   struct rusage r_usage;
   MyReal StartTime, StopTime, myMB, globalMB;
+  MyReal progresstime, maxprogresstime;
+  MyReal ghostwait[2], maxghostwait[2]; /* Without (0) / with (1) progress */
+  MyReal solvetime[2] = {0.0, 0.0};     /* Time of the braid solves */
+  MyReal maxsolvetime[2];
+  MyReal iterwait[2], maxiterwait[2]; /* Ghost layer wait of the iterations */
+  int nprogressiter[2] = {0, 0}; /* Iterations without / with progress */
+  int progress;
+  MyReal solvestart;
+  MyReal gradwait, maxgradwait;
+  int nprogress, maxnprogress;
   MyReal UsedTime = 0.0;
 
-  /* Initialize MPI */
-  MPI_Init(&argc, &argv);
+  /* Initialize MPI. Only the main thread calls MPI, the threads of the
+   * network's pool compute. */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   MPI_Comm_rank(MPI_COMM_WORLD, &myid);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
 
@@ -112,29 +134,125 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  if (config->braid_nthreads > 1 && provided < MPI_THREAD_FUNNELED) {
+    if (myid == MASTER_NODE) {
+      printf("\n WARNING: The MPI library doesn't support threads, using "
+             "braid_nthreads = 1.\n\n");
+    }
+    config->braid_nthreads = 1;
+  }
+
+  /* Split the processors into data parallel replicas. Each replica is a
+   * group of layer-parallel processors, and each layer block is shared by
+   * ntensor neighbouring processors. */
+  ntensor = config->ntensor;
+  if (config->nreplicas < 1 || ntensor < 1 ||
+      size % (config->nreplicas * ntensor) != 0 ||
+      config->nbatch < config->nreplicas ||
+      config->nvalidation < config->nreplicas) {
+    if (myid == MASTER_NODE) {
+      printf("\n\n ERROR: nreplicas * ntensor must divide the number of "
+             "processors, nreplicas must be at most nbatch and "
+             "nvalidation!\n\n");
+    }
+    MPI_Finalize();
+    return 0;
+  }
+  nreplicaranks = size / config->nreplicas;
+  MPI_Comm_split(MPI_COMM_WORLD, (myid / nreplicaranks) * ntensor +
+                 myid % ntensor, myid, &layercomm);
+  MPI_Comm_split(MPI_COMM_WORLD, myid % nreplicaranks, myid, &replicacomm);
+  MPI_Comm_split(MPI_COMM_WORLD, myid / ntensor, myid, &tensorcomm);
+
+  /* The F-interval tasks can't exchange the layer outputs */
+  if (ntensor > 1 && config->braid_ftasks) {
+    if (myid == MASTER_NODE) {
+      printf("\n WARNING: braid_ftasks is not supported with ntensor > 1, "
+             "using braid_ftasks = 0.\n\n");
+    }
+    config->braid_ftasks = 0;
+  }
+
+  /* Low rank coarse layers approximate dense weights */
+  if (config->braid_coarseprop == COARSEPROP_LOWRANK &&
+      config->network_type != DENSE) {
+    if (myid == MASTER_NODE) {
+      printf("\n WARNING: braid_coarseprop = lowrank needs a dense network, "
+             "using braid_coarseprop = average.\n\n");
+    }
+    config->braid_coarseprop = COARSEPROP_AVERAGE;
+  }
+
+  /* Only the images of convolutional networks can be coarsened */
+  if (config->braid_spatialcoarsen > 0 &&
+      config->network_type != CONVOLUTIONAL) {
+    if (myid == MASTER_NODE) {
+      printf("\n WARNING: braid_spatialcoarsen needs a convolutional network, "
+             "using braid_spatialcoarsen = 0.\n\n");
+    }
+    config->braid_spatialcoarsen = 0;
+  }
+
+  /* Without layer parallelism or coarse levels, braid only adds overhead to
+   * sweeps over the layers */
+  if (config->braid_serial == SERIAL_AUTO) {
+    int nlayerranks = nreplicaranks / ntensor;
+    if (nlayerranks == 1 || config->braid_maxlevels == 1) {
+      config->braid_serial = SERIAL_ON;
+    } else {
+      config->braid_serial = SERIAL_OFF;
+    }
+  }
+
+  /* The one-shot iteration continues from braid's last grid, and replaces
+   * the linesearch by its own stepsize control */
+  if (config->optim_oneshot > 0) {
+    if (config->braid_warmstart == WARMSTART_NONE) {
+      if (myid == MASTER_NODE) {
+        printf("\n WARNING: optim_oneshot needs a warm start, using "
+               "braid_warmstart = grid.\n\n");
+      }
+      config->braid_warmstart = WARMSTART_GRID;
+    }
+    if (config->stepsize_type == BACKTRACKINGLS) {
+      if (myid == MASTER_NODE) {
+        printf("\n WARNING: optim_oneshot controls the stepsize itself, "
+               "using stepsize_type = fixed.\n\n");
+      }
+      config->stepsize_type = FIXED;
+    }
+  }
+
+  /* Start the threads, they first touch the data and the network */
+  network->createThreadPool(config);
+
   /* Initialize training and validation data */
   trainingdata->initialize(config->ntraining, config->nfeatures,
-                           config->nclasses, config->nbatch, MPI_COMM_WORLD);
+                           config->nclasses, config->nbatch, layercomm,
+                           network->getThreadPool());
+  trainingdata->setReplicas(replicacomm);
   trainingdata->readData(config->datafolder, config->ftrain_ex,
                          config->ftrain_labels);
 
+  /* The validation set is sharded over the replicas like the training set,
+   * its loss and accuracy are averaged over them */
   validationdata->initialize(config->nvalidation, config->nfeatures,
-                             config->nclasses, config->nvalidation,
-                             MPI_COMM_WORLD);  // full validation set!
+                             config->nclasses, config->nvalidation, layercomm,
+                             network->getThreadPool());
+  validationdata->setReplicas(replicacomm);
   validationdata->readData(config->datafolder, config->fval_ex,
                            config->fval_labels);
 
   /* Initialize XBraid */
-  primaltrainapp =
-      new myBraidApp(trainingdata, network, config, MPI_COMM_WORLD);
-  adjointtrainapp = new myAdjointBraidApp(
-      trainingdata, network, config, primaltrainapp->getCore(), MPI_COMM_WORLD);
-  primalvalapp =
-      new myBraidApp(validationdata, network, config, MPI_COMM_WORLD);
+  primaltrainapp = new myBraidApp(trainingdata, network, config, layercomm);
+  adjointtrainapp = new myAdjointBraidApp(trainingdata, network, config,
+                                          primaltrainapp, layercomm);
+  primalvalapp = new myBraidApp(validationdata, network, config, layercomm);
 
   /* Initialize the network  */
   primaltrainapp->GetGridDistribution(&ilower, &iupper);
-  network->createNetworkBlock(ilower, iupper, config, MPI_COMM_WORLD);
+  if (ntensor > 1) network->setTensorComm(tensorcomm);
+  network->createNetworkBlock(ilower, iupper, config, layercomm);
   network->setInitialDesign(config);
   ndesign_local = network->getnDesignLocal();
   ndesign_global = network->getnDesignGlobal();
@@ -144,18 +262,19 @@ int main(int argc, char *argv[]) {
          config->nlayers);
   printf("%d: Design variables (local/global): %d/%d\n", myid, ndesign_local,
          ndesign_global);
+  network->getThreadPool()->writeBinding(stdout, MPI_COMM_WORLD);
 
   /* Initialize Hessian approximation */
   HessianApprox *hessian = 0;
   switch (config->hessianapprox_type) {
     case BFGS_SERIAL:
-      hessian = new BFGS(MPI_COMM_WORLD, ndesign_local);
+      hessian = new BFGS(layercomm, ndesign_local);
       break;
     case LBFGS:
-      hessian = new L_BFGS(MPI_COMM_WORLD, ndesign_local, config->lbfgs_stages);
+      hessian = new L_BFGS(layercomm, ndesign_local, config->lbfgs_stages);
       break;
     case IDENTITY:
-      hessian = new Identity(MPI_COMM_WORLD, ndesign_local);
+      hessian = new Identity(layercomm, ndesign_local);
       break;
     default:
       printf("Error: unexpected hessianapprox_type returned");
@@ -174,12 +293,17 @@ int main(int argc, char *argv[]) {
   ls_param = 1e-4;
   ls_iter = 0;
   ls_stepsize = stepsize;
+  oneshotscale = 1.0;
+  oneshotobjective = 0.0;
 
   /* Open and prepare optimization output file*/
   if (myid == MASTER_NODE) {
     sprintf(optimfilename, "%s.dat", "optim");
     optimfile = fopen(optimfilename, "w");
     config->writeToFile(optimfile);
+  }
+  network->getThreadPool()->writeBinding(optimfile, MPI_COMM_WORLD);
+  if (myid == MASTER_NODE) {
     fprintf(optimfile,
             "#    || r ||          || r_adj ||      Objective             Loss "
             "                 || grad ||            Stepsize  ls_iter   "
@@ -198,7 +322,26 @@ int main(int argc, char *argv[]) {
    */
   for (int iter = 0; iter < config->maxoptimiter; iter++) {
     /* Set up the current batch */
-    trainingdata->selectBatch(config->batch_type, MPI_COMM_WORLD);
+    trainingdata->selectBatch(config->batch_type, layercomm);
+
+    /* Braid tolerances of this iteration (relative to the last gradient
+     * norm for inexact solves) */
+    MyReal tol = config->getBraidTol(0, iter > 0 ? gnorm : -1.0);
+    MyReal tol_adj = config->getBraidTol(1, iter > 0 ? gnorm : -1.0);
+    if (config->optim_oneshot > 0) {
+      /* One-shot: a few braid iterations per design update */
+      primaltrainapp->setTolerance(tol, config->optim_oneshot);
+      adjointtrainapp->setTolerance(tol_adj, config->optim_oneshot);
+    } else {
+      primaltrainapp->setTolerance(tol, config->braid_maxiter);
+      adjointtrainapp->setTolerance(tol_adj, config->braid_maxiteradj);
+    }
+
+    /* Measure what the progress calls remove: leave them out in every
+     * other iteration (doesn't change the results) */
+    if (config->braid_progresscompare) network->setProgress(iter % 2);
+    progress = network->getProgress();
+    solvestart = MPI_Wtime();
 
     /** Solve state and adjoint equations (2.15) and (2.17)
      *
@@ -206,37 +349,71 @@ int main(int argc, char *argv[]) {
      */
     rnorm = primaltrainapp->run();
     rnorm_adj = adjointtrainapp->run();
+    if (config->braid_inexact && myid == MASTER_NODE) {
+      printf("Inexact braid solves: tol %1.2e (%d iter), tol_adj %1.2e "
+             "(%d iter)\n",
+             tol, primaltrainapp->getnIter(), tol_adj,
+             adjointtrainapp->getnIter());
+    }
 
     /* Get output */
     objective = primaltrainapp->getObjective();
-    loss_train = network->getLoss();
-    accur_train = network->getAccuracy();
+    loss_train = trainingdata->reduceReplicas(network->getLoss());
+    accur_train = trainingdata->reduceReplicas(network->getAccuracy());
 
     /* --- Validation data: Get accuracy --- */
     if (config->validationlevel > 0) {
       primalvalapp->run();
-      loss_val = network->getLoss();
-      accur_val = network->getAccuracy();
+      loss_val = validationdata->reduceReplicas(network->getLoss());
+      accur_val = validationdata->reduceReplicas(network->getAccuracy());
     }
 
+    solvetime[progress] += MPI_Wtime() - solvestart;
+    nprogressiter[progress]++;
+
     /* --- Optimization control and output ---*/
 
+    /* Finish averaging the gradient over the data parallel replicas */
+    adjointtrainapp->getGradientExchange()->wait();
+    if (config->gradient_verify && config->nreplicas > 1 &&
+        config->gradient_compress != GRADCOMPRESS_NONE) {
+      MyReal relerror, exactnorm;
+      adjointtrainapp->getGradientExchange()->getVerification(&relerror,
+                                                              &exactnorm);
+      if (myid == MASTER_NODE) {
+        printf("Gradient compression: rel. error %1.4e, exact || grad || "
+               "%1.14e\n",
+               relerror, exactnorm);
+      }
+    }
+
     /** Compute global gradient norm
      *
      *  Algorithm (2): Step 3
      */
-    gnorm = vecnorm_par(ndesign_local, network->getGradient(), MPI_COMM_WORLD);
+    gnorm = vecnorm_par(ndesign_local, network->getGradient(), layercomm);
+
+    /* One-shot: the gradient is only trusted as far as the braid residuals
+     * are small compared to it. The step shrinks by that factor (norms < 0
+     * are not available). */
+    MyReal resscale = 1.0;
+    if (config->optim_oneshot > 0) {
+      MyReal resnorm = std::max(rnorm, rnorm_adj);
+      if (resnorm > 0.0) {
+        resscale =
+            std::min(1.0, config->optim_oneshotrtol * gnorm / resnorm);
+      }
+    }
 
     /* Communicate loss and accuracy. This is actually only needed for output.
      * TODO: Remove it. */
     MPI_Allreduce(&loss_train, &losstrain_out, 1, MPI_MyReal, MPI_SUM,
-                  MPI_COMM_WORLD);
-    MPI_Allreduce(&loss_val, &lossval_out, 1, MPI_MyReal, MPI_SUM,
-                  MPI_COMM_WORLD);
+                  layercomm);
+    MPI_Allreduce(&loss_val, &lossval_out, 1, MPI_MyReal, MPI_SUM, layercomm);
     MPI_Allreduce(&accur_train, &accurtrain_out, 1, MPI_MyReal, MPI_SUM,
-                  MPI_COMM_WORLD);
+                  layercomm);
     MPI_Allreduce(&accur_val, &accurval_out, 1, MPI_MyReal, MPI_SUM,
-                  MPI_COMM_WORLD);
+                  layercomm);
 
     /* Output */
     StopTime = MPI_Wtime();
@@ -262,7 +439,7 @@ int main(int argc, char *argv[]) {
      *
      *  Algorithm (2): Step 6
      */
-    if (gnorm < config->gtol) {
+    if (gnorm < config->gtol && resscale == 1.0) {
       if (myid == MASTER_NODE) {
         printf("Optimization has converged. \n");
         printf("Be happy and go home!       \n");
@@ -288,17 +465,29 @@ int main(int argc, char *argv[]) {
     hessian->computeAscentDir(iter, network->getGradient(), ascentdir);
     stepsize = config->getStepsize(iter);
 
+    /* One-shot: shrink the steps while the objective grows, let them grow
+     * back otherwise, and shrink them by the braid residuals */
+    if (config->optim_oneshot > 0) {
+      if (iter > 0 && objective > oneshotobjective) {
+        oneshotscale *= config->ls_factor;
+      } else {
+        oneshotscale = std::min(1.0, oneshotscale / config->ls_factor);
+      }
+      oneshotobjective = objective;
+      stepsize *= oneshotscale * resscale;
+    }
+
     /** Update the design/network control parameter in negative ascent direction
      *  and perform backtracking linesearch.
      *
      *  Algorithm (2): Step 5
      */
-    network->updateDesign(-1.0 * stepsize, ascentdir, MPI_COMM_WORLD);
+    network->updateDesign(-1.0 * stepsize, ascentdir, layercomm);
 
     if (config->stepsize_type == BACKTRACKINGLS) {
       /* Compute wolfe condition */
       wolfe = vecdot_par(ndesign_local, network->getGradient(), ascentdir,
-                         MPI_COMM_WORLD);
+                         layercomm);
 
       /* Start linesearch iterations */
       ls_stepsize = config->getStepsize(iter);
@@ -327,7 +516,7 @@ int main(int argc, char *argv[]) {
 
           /* Go back part of the step */
           network->updateDesign((1.0 - config->ls_factor) * stepsize, ascentdir,
-                                MPI_COMM_WORLD);
+                                layercomm);
 
           /* Decrease the stepsize */
           ls_stepsize = ls_stepsize * config->ls_factor;
@@ -337,13 +526,16 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  network->getCommTimings(iterwait, &progresstime, &nprogress);
+  network->setProgress(1);
+
   /* --- Run final validation and write prediction file --- */
   if (config->validationlevel > -1) {
     if (myid == MASTER_NODE) printf("\n --- Run final validation ---\n");
 
     primalvalapp->getCore()->SetPrintLevel(0);
     primalvalapp->run();
-    loss_val = network->getLoss();
+    loss_val = validationdata->reduceReplicas(network->getLoss());
 
     printf("Final validation accuracy:  %2.2f%%\n", accur_val);
   }
@@ -356,6 +548,20 @@ int main(int argc, char *argv[]) {
   getrusage(RUSAGE_SELF, &r_usage);
   myMB = (MyReal)r_usage.ru_maxrss / 1024.0;
   MPI_Allreduce(&myMB, &globalMB, 1, MPI_MyReal, MPI_SUM, MPI_COMM_WORLD);
+  network->getCommTimings(ghostwait, &progresstime, &nprogress);
+  MPI_Reduce(ghostwait, maxghostwait, 2, MPI_MyReal, MPI_MAX, MASTER_NODE,
+             MPI_COMM_WORLD);
+  MPI_Reduce(iterwait, maxiterwait, 2, MPI_MyReal, MPI_MAX, MASTER_NODE,
+             MPI_COMM_WORLD);
+  MPI_Reduce(solvetime, maxsolvetime, 2, MPI_MyReal, MPI_MAX, MASTER_NODE,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&progresstime, &maxprogresstime, 1, MPI_MyReal, MPI_MAX,
+             MASTER_NODE, MPI_COMM_WORLD);
+  MPI_Reduce(&nprogress, &maxnprogress, 1, MPI_INT, MPI_MAX, MASTER_NODE,
+             MPI_COMM_WORLD);
+  gradwait = adjointtrainapp->getGradientExchange()->getWaitTime();
+  MPI_Reduce(&gradwait, &maxgradwait, 1, MPI_MyReal, MPI_MAX, MASTER_NODE,
+             MPI_COMM_WORLD);
 
   // printf("%d; Memory Usage: %.2f MB\n",myid, myMB);
   if (myid == MASTER_NODE) {
@@ -363,9 +569,41 @@ int main(int argc, char *argv[]) {
     printf(" Used Time:        %.2f seconds\n", UsedTime);
     printf(" Global Memory:    %.2f MB\n", globalMB);
     printf(" Processors used:  %d\n", size);
+    printf(" Ghost layer wait: %.4f seconds (max)\n",
+           maxghostwait[0] + maxghostwait[1]);
+    printf(" MPI progress:     %.4f seconds, %d calls (max)\n",
+           maxprogresstime, maxnprogress);
+    printf(" Gradient wait:    %.4f seconds (max)\n", maxgradwait);
+    /* Per iteration without (0) and with (1) progress calls. The solve
+     * time includes the wait for braid's messages. */
+    for (int i = 0; i < 2; i++) {
+      if (nprogressiter[i] == 0) continue;
+      printf(" %s progress: solves %.4f, ghost layer wait %.4f seconds per "
+             "iteration (max, %d iterations)\n",
+             i ? "With   " : "Without", maxsolvetime[i] / nprogressiter[i],
+             maxiterwait[i] / nprogressiter[i], nprogressiter[i]);
+    }
+    if (nprogressiter[0] > 0 && nprogressiter[1] > 0) {
+      printf(" Removed by progress: solves %.4f, ghost layer wait %.4f "
+             "seconds per iteration\n",
+             maxsolvetime[0] / nprogressiter[0] -
+                 maxsolvetime[1] / nprogressiter[1],
+             maxiterwait[0] / nprogressiter[0] -
+                 maxiterwait[1] / nprogressiter[1]);
+    }
     printf("\n");
   }
 
+  /* Cost of the braid levels and convergence of the training solves */
+  primaltrainapp->writeLevelStats(stdout, "Primal", MPI_COMM_WORLD);
+  adjointtrainapp->writeLevelStats(stdout, "Adjoint", MPI_COMM_WORLD);
+
+  /* Cost of the time points, and the blocks that would balance it */
+  LoadBalance loadbalance(network, ilower, iupper, layercomm);
+  loadbalance.writeReport(myid == MASTER_NODE ? stdout : NULL, primaltrainapp,
+                          adjointtrainapp);
+  if (myid == MASTER_NODE) printf("\n");
+
   /* Clean up XBraid */
   delete network;
 
@@ -389,6 +627,10 @@ int main(int argc, char *argv[]) {
 
   delete config;
 
+  MPI_Comm_free(&layercomm);
+  MPI_Comm_free(&replicacomm);
+  MPI_Comm_free(&tensorcomm);
+
   MPI_Finalize();
   return 0;
 }
@@ -45,9 +45,46 @@ Network::Network() {
   layer_left = NULL;
   layer_right = NULL;
 
+  designversion = 0;
+  layer_owner = NULL;
+  layer_offset = NULL;
+  designwin = MPI_WIN_NULL;
+  layer_cache = NULL;
+  layer_cache_version = NULL;
+  netconfig = NULL;
+  nghostreq = 0;
+  ghostinflight = 0;
+  threads = NULL;
+  ghostwaittime[0] = 0.0;
+  ghostwaittime[1] = 0.0;
+  progresstime = 0.0;
+  nprogress = 0;
+  progressinterval = 0;
+  progresson = 0;
+
   comm = MPI_COMM_WORLD;
+  tensorcomm = MPI_COMM_NULL;
+}
+
+void Network::createThreadPool(Config *config) {
+  threads = new ThreadPool(config->braid_nthreads, config->braid_pinning,
+                           config->braid_hugepages);
+  progressinterval = config->braid_progress;
+  setProgress(1);
+}
+
+void Network::setProgress(int on) {
+  if (progressinterval <= 0) return;
+
+  progresson = on;
+  threads->setProgress(on ? progressinterval : 0,
+                       [this]() { progressCommunication(); });
 }
 
+int Network::getProgress() { return progresson; }
+
+void Network::setTensorComm(MPI_Comm TensorComm) { tensorcomm = TensorComm; }
+
 void Network::createNetworkBlock(int StartLayerID, int EndLayerID,
                                  Config *config, MPI_Comm Comm) {
   /* Initilizize */
@@ -58,6 +95,7 @@ void Network::createNetworkBlock(int StartLayerID, int EndLayerID,
   nchannels = config->nchannels;
   dt = (config->T) / (MyReal)(config->nlayers - 2);  // nlayers-2 = nhiddenlayers
   comm = Comm;
+  netconfig = config;
 
   /* --- Create the layers --- */
   ndesign_local = 0;
@@ -98,8 +136,8 @@ void Network::createNetworkBlock(int StartLayerID, int EndLayerID,
   ndesign_layermax = computeLayermax();
 
   /* Allocate memory for network design and gradient variables */
-  design = new MyReal[ndesign_local];
-  gradient = new MyReal[ndesign_local];
+  design = threads->allocate(ndesign_local, 1);
+  gradient = threads->allocate(ndesign_local, 1);
 
   /* Set the memory locations for all layers */
   int istart = 0;
@@ -128,9 +166,72 @@ void Network::createNetworkBlock(int StartLayerID, int EndLayerID,
     MyReal *right_gradient = new MyReal[layer_right->getnDesign()];
     layer_right->setMemory(right_design, right_gradient);
   }
+
+  /* Collect owner and design offset of all layers (index + 1, includes the
+   * opening layer) */
+  int nlayers_all = nlayers_global;
+  int *myowner = new int[nlayers_all];
+  int *myoffset = new int[nlayers_all];
+  for (int i = 0; i < nlayers_all; i++) {
+    myowner[i] = -1;
+    myoffset[i] = -1;
+  }
+  int myid;
+  MPI_Comm_rank(comm, &myid);
+  if (openlayer != NULL) {
+    myowner[0] = myid;
+    myoffset[0] = 0;
+  }
+  for (int ilayer = startlayerID; ilayer <= endlayerID; ilayer++) {
+    myowner[ilayer + 1] = myid;
+    myoffset[ilayer + 1] = layers[getLocalID(ilayer)]->getWeights() - design;
+  }
+  layer_owner = new int[nlayers_all];
+  layer_offset = new int[nlayers_all];
+  MPI_Allreduce(myowner, layer_owner, nlayers_all, MPI_INT, MPI_MAX, comm);
+  MPI_Allreduce(myoffset, layer_offset, nlayers_all, MPI_INT, MPI_MAX, comm);
+  delete[] myowner;
+  delete[] myoffset;
+
+  /* Expose the design for fetching remote layers */
+  MPI_Win_create(design, ndesign_local * sizeof(MyReal), sizeof(MyReal),
+                 MPI_INFO_NULL, comm, &designwin);
+
+  /* Persistent requests for exchanging the ghost layers in place. Tag 0:
+   * last layer to the right, tag 1: first layer to the left */
+  int comm_size;
+  MPI_Comm_size(comm, &comm_size);
+  if (myid > 0) {
+    MPI_Recv_init(layer_left->getWeights(), layer_left->getnDesign(),
+                  MPI_MyReal, myid - 1, 0, comm, &ghostreq[nghostreq++]);
+    Layer *first = layers[getLocalID(startlayerID)];
+    MPI_Send_init(first->getWeights(), first->getnDesign(), MPI_MyReal,
+                  myid - 1, 1, comm, &ghostreq[nghostreq++]);
+  }
+  if (myid < comm_size - 1) {
+    MPI_Recv_init(layer_right->getWeights(), layer_right->getnDesign(),
+                  MPI_MyReal, myid + 1, 1, comm, &ghostreq[nghostreq++]);
+    Layer *last = layers[getLocalID(endlayerID)];
+    MPI_Send_init(last->getWeights(), last->getnDesign(), MPI_MyReal,
+                  myid + 1, 0, comm, &ghostreq[nghostreq++]);
+  }
+
+  /* Empty cache of remote layers */
+  layer_cache = new Layer *[nlayers_all];
+  layer_cache_version = new int[nlayers_all];
+  for (int i = 0; i < nlayers_all; i++) {
+    layer_cache[i] = NULL;
+    layer_cache_version[i] = -1;
+  }
 }
 
 Network::~Network() {
+  /* Free the ghost layer requests */
+  finishGhostExchange();
+  for (int i = 0; i < nghostreq; i++) {
+    MPI_Request_free(&ghostreq[i]);
+  }
+
   /* Delete openlayer */
   if (openlayer != NULL) delete openlayer;
 
@@ -141,8 +242,8 @@ Network::~Network() {
   delete[] layers;
 
   /* Delete design and gradient */
-  delete[] design;
-  delete[] gradient;
+  ThreadPool::deallocate(design);
+  ThreadPool::deallocate(gradient);
 
   /* Delete neighbouring layer information */
   if (layer_left != NULL) {
@@ -156,6 +257,24 @@ Network::~Network() {
     delete[] layer_right->getWeightsBar();
     delete layer_right;
   }
+
+  /* Delete the cache of remote layers */
+  if (layer_cache != NULL) {
+    for (int i = 0; i < nlayers_global; i++) {
+      if (layer_cache[i] != NULL) {
+        delete[] layer_cache[i]->getWeights();
+        delete[] layer_cache[i]->getWeightsBar();
+        delete layer_cache[i];
+      }
+    }
+    delete[] layer_cache;
+    delete[] layer_cache_version;
+  }
+  if (layer_owner != NULL) delete[] layer_owner;
+  if (layer_offset != NULL) delete[] layer_offset;
+  if (designwin != MPI_WIN_NULL) MPI_Win_free(&designwin);
+
+  if (threads != NULL) delete threads;
 }
 
 int Network::getnChannels() { return nchannels; }
@@ -186,6 +305,10 @@ int Network::getEndLayerID() { return endlayerID; }
 
 MPI_Comm Network::getComm() { return comm; }
 
+int Network::getDesignVersion() { return designversion; }
+
+ThreadPool *Network::getThreadPool() { return threads; }
+
 Layer *Network::createLayer(int index, Config *config) {
   Layer *layer = 0;
   if (index == -1)  // Opening layer
@@ -225,6 +348,7 @@ Layer *Network::createLayer(int index, Config *config) {
                           config->gamma_tik, config->gamma_ddt);
         break;
     }
+    if (tensorcomm != MPI_COMM_NULL) layer->setTensorComm(tensorcomm);
   } else if (index == nlayers_global - 2)  // Classification layer
   {
     layer = new ClassificationLayer(index, nchannels, config->nclasses,
@@ -233,6 +357,9 @@ Layer *Network::createLayer(int index, Config *config) {
     layer = NULL;
   }
 
+  /* Per-thread storage for applying the layer to the examples in parallel */
+  if (layer != NULL) layer->setnThreads(threads->getnThreads());
+
   return layer;
 }
 
@@ -243,10 +370,12 @@ Layer *Network::getLayer(int layerindex) {
   {
     layer = openlayer;
   } else if (layerindex == startlayerID - 1) {
+    finishGhostExchange();
     layer = layer_left;
   } else if (startlayerID <= layerindex && layerindex <= endlayerID) {
     layer = layers[getLocalID(layerindex)];
   } else if (layerindex == endlayerID + 1) {
+    finishGhostExchange();
     layer = layer_right;
   } else {
     layer = NULL;
@@ -255,6 +384,43 @@ Layer *Network::getLayer(int layerindex) {
   return layer;
 }
 
+Layer *Network::getRemoteLayer(int layerindex, int version) {
+  /* Local layers and ghost layers are up to date */
+  Layer *layer = getLayer(layerindex);
+  if (layer != NULL) return layer;
+
+  if (version != designversion) {
+    printf("\n\n ERROR: Layer %d requested for design version %d, current "
+           "version is %d!\n\n",
+           layerindex, version, designversion);
+    exit(1);
+  }
+
+  /* Create the cached copy of the layer on first use */
+  int id = layerindex + 1;
+  if (layer_cache[id] == NULL) {
+    layer_cache[id] = createLayer(layerindex, netconfig);
+    int ndesign = layer_cache[id]->getnDesign();
+    MyReal *cache_design = new MyReal[ndesign];
+    MyReal *cache_gradient = new MyReal[ndesign];
+    layer_cache[id]->setMemory(cache_design, cache_gradient);
+  }
+  layer = layer_cache[id];
+
+  /* Fetch the design from the owner, if the cached one is outdated */
+  if (layer_cache_version[id] != designversion) {
+    int owner = layer_owner[id];
+    int ndesign = layer->getnDesign();
+    MPI_Win_lock(MPI_LOCK_SHARED, owner, 0, designwin);
+    MPI_Get(layer->getWeights(), ndesign, MPI_MyReal, owner, layer_offset[id],
+            ndesign, MPI_MyReal, designwin);
+    MPI_Win_unlock(owner, designwin);
+    layer_cache_version[id] = designversion;
+  }
+
+  return layer;
+}
+
 int Network::getnDesignLayermax() { return ndesign_layermax; }
 
 int Network::computeLayermax() {
@@ -339,109 +505,87 @@ void Network::setInitialDesign(Config *config) {
 
   /* Communicate the neighbours across processors */
   MPI_CommunicateNeighbours(comm);
+  publishDesign();
 
   if (myid == 0) delete[] design_init;
 }
 
 void Network::MPI_CommunicateNeighbours(MPI_Comm comm) {
-  int myid, comm_size;
-  MPI_Comm_rank(comm, &myid);
-  MPI_Comm_size(comm, &comm_size);
-  MPI_Request sendlastreq, recvlastreq;
-  MPI_Request sendfirstreq, recvfirstreq;
-  MPI_Status status;
-
-  /* Allocate buffers */
-  int size_left = -1;
-  int size_right = -1;
-
-  MyReal *sendlast = 0;
-  MyReal *recvlast = 0;
-  MyReal *sendfirst = 0;
-  MyReal *recvfirst = 0;
-
-  /* --- All but the first process receive the last layer from left neighbour
-   * --- */
-  if (myid > 0) {
-    /* Receive from left neighbour */
-    int source = myid - 1;
+  startGhostExchange();
+  finishGhostExchange();
+}
 
-    size_left = layer_left->getnDesign();
-    recvlast = new MyReal[size_left];
+void Network::startGhostExchange() {
+  /* The designs are sent in place, finish the previous exchange first */
+  finishGhostExchange();
 
-    MPI_Irecv(recvlast, size_left, MPI_MyReal, source, 0, comm, &recvlastreq);
+  if (nghostreq > 0) {
+    MPI_Startall(nghostreq, ghostreq);
+    ghostinflight = 1;
   }
+}
 
-  /* --- All but the last process sent their last layer to right neighbour ---
-   */
-  if (myid < comm_size - 1) {
-    size_left = layers[getLocalID(endlayerID)]->getnDesign();
-    sendlast = new MyReal[size_left];
-
-    /* Pack the last layer into a buffer */
-    layers[getLocalID(endlayerID)]->packDesign(sendlast, size_left);
+void Network::finishGhostExchange() {
+  if (!ghostinflight) return;
 
-    /* Send to right neighbour */
-    int receiver = myid + 1;
-    MPI_Isend(sendlast, size_left, MPI_MyReal, receiver, 0, comm, &sendlastreq);
-  }
-
-  /* --- All but the last processor recv the first layer from the right
-   * neighbour --- */
-  if (myid < comm_size - 1) {
-    /* Receive from right neighbour */
-    int source = myid + 1;
+  MyReal start = MPI_Wtime();
+  MPI_Waitall(nghostreq, ghostreq, MPI_STATUSES_IGNORE);
+  ghostinflight = 0;
+  ghostwaittime[progresson] += MPI_Wtime() - start;
+}
 
-    size_right = layer_right->getnDesign();
-    recvfirst = new MyReal[size_right];
+void Network::publishDesign() {
+  int myid;
+  MPI_Comm_rank(comm, &myid);
 
-    MPI_Irecv(recvfirst, size_right, MPI_MyReal, source, 1, comm,
-              &recvfirstreq);
-  }
+  /* Sync the public copy of the window with the local stores */
+  MPI_Win_lock(MPI_LOCK_SHARED, myid, 0, designwin);
+  MPI_Win_sync(designwin);
+  MPI_Win_unlock(myid, designwin);
 
-  /* --- All but the first processor send their first layer to the left
-   * neighbour --- */
-  if (myid > 0) {
-    size_right = layers[getLocalID(startlayerID)]->getnDesign();
-    sendfirst = new MyReal[size_right];
+  /* No processor fetches the new version before all owners have stored it */
+  MPI_Barrier(comm);
+}
 
-    /* Pack the first layer into a buffer */
-    layers[getLocalID(startlayerID)]->packDesign(sendfirst, size_right);
+void Network::progressCommunication() {
+  int flag;
+  MyReal start = MPI_Wtime();
 
-    /* Send to left neighbour */
-    int receiver = myid - 1;
-    MPI_Isend(sendfirst, size_right, MPI_MyReal, receiver, 1, comm,
-              &sendfirstreq);
+  /* Complete the ghost layer exchange, if it's done */
+  if (ghostinflight) {
+    MPI_Testall(nghostreq, ghostreq, &flag, MPI_STATUSES_IGNORE);
+    if (flag) ghostinflight = 0;
   }
 
-  /* Wait to finish up communication */
-  if (myid > 0) MPI_Wait(&recvlastreq, &status);
-  if (myid < comm_size - 1) MPI_Wait(&sendlastreq, &status);
-  if (myid < comm_size - 1) MPI_Wait(&recvfirstreq, &status);
-  if (myid > 0) MPI_Wait(&sendfirstreq, &status);
+  /* Drive the progress engine for the other messages (braid) */
+  MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm, &flag, MPI_STATUS_IGNORE);
 
-  /* Unpack and store the left received layer */
-  if (myid > 0) {
-    layer_left->unpackDesign(recvlast);
-  }
+  progresstime += MPI_Wtime() - start;
+  nprogress++;
+}
 
-  /* Unpack and store the right received layer */
-  if (myid < comm_size - 1) {
-    layer_right->unpackDesign(recvfirst);
-  }
+void Network::getCommTimings(MyReal ghostwait[2], MyReal *progress_ptr,
+                             int *nprogress_ptr) {
+  ghostwait[0] = ghostwaittime[0];
+  ghostwait[1] = ghostwaittime[1];
+  *progress_ptr = progresstime;
+  *nprogress_ptr = nprogress;
+}
 
-  /* Free the buffer */
-  if (sendlast != 0) delete[] sendlast;
-  if (recvlast != 0) delete[] recvlast;
-  if (sendfirst != 0) delete[] sendfirst;
-  if (recvfirst != 0) delete[] recvfirst;
+void Network::waitForLayer(int layerindex) {
+  if (layerindex == startlayerID - 1 || layerindex == endlayerID + 1) {
+    finishGhostExchange();
+  }
 }
 
 void Network::evalClassification(DataSet *data, MyReal **state, int output) {
-  MyReal *tmpstate = new MyReal[nchannels];
+  int nbatch = data->getnBatch();
+  MyReal *tmpstate = new MyReal[threads->getnThreads() * nchannels];
+  MyReal *loss_local = new MyReal[nbatch];
+  int *class_id = new int[nbatch];
+  int *success_local = new int[nbatch];
 
-  int class_id;
-  int success, success_local;
+  int success;
   FILE *classfile;
   ClassificationLayer *classificationlayer;
 
@@ -456,26 +600,36 @@ void Network::evalClassification(DataSet *data, MyReal **state, int output) {
   /* open file for printing predicted file */
   if (output) classfile = fopen("classprediction.dat", "w");
 
+  /* Classify the examples in parallel */
+  threads->parallelFor(nbatch, [&](int first, int last) {
+    MyReal *tmp = tmpstate + ThreadPool::getThreadID() * nchannels;
+    for (int iex = first; iex < last; iex++) {
+      /* Copy values so that they are not overwrittn (they are needed for
+       * adjoint)*/
+      for (int ic = 0; ic < nchannels; ic++) {
+        tmp[ic] = state[iex][ic];
+      }
+      /* Apply classification on tmpstate */
+      classificationlayer->setLabel(data->getLabel(iex));
+      classificationlayer->applyFWD(tmp);
+      /* Evaluate Loss */
+      loss_local[iex] = classificationlayer->crossEntropy(tmp);
+      success_local[iex] = classificationlayer->prediction(tmp, &class_id[iex]);
+    }
+  });
+
+  /* Sum up in the order of the examples */
   loss = 0.0;
   accuracy = 0.0;
   success = 0;
-  for (int iex = 0; iex < data->getnBatch(); iex++) {
-    /* Copy values so that they are not overwrittn (they are needed for
-     * adjoint)*/
-    for (int ic = 0; ic < nchannels; ic++) {
-      tmpstate[ic] = state[iex][ic];
-    }
-    /* Apply classification on tmpstate */
-    classificationlayer->setLabel(data->getLabel(iex));
-    classificationlayer->applyFWD(tmpstate);
-    /* Evaluate Loss */
-    loss += classificationlayer->crossEntropy(tmpstate);
-    success_local = classificationlayer->prediction(tmpstate, &class_id);
-    success += success_local;
-    if (output) fprintf(classfile, "%d   %d\n", class_id, success_local);
-  }
-  loss = 1. / data->getnBatch() * loss;
-  accuracy = 100.0 * ((MyReal)success) / data->getnBatch();
+  for (int iex = 0; iex < nbatch; iex++) {
+    loss += loss_local[iex];
+    success += success_local[iex];
+    if (output)
+      fprintf(classfile, "%d   %d\n", class_id[iex], success_local[iex]);
+  }
+  loss = 1. / nbatch * loss;
+  accuracy = 100.0 * ((MyReal)success) / nbatch;
   // printf("Classification %d: %1.14e using layer %1.14e state %1.14e
   // tmpstate[0] %1.14e\n", getIndex(), loss, weights[0], state[1][1],
   // tmpstate[0]);
@@ -484,12 +638,15 @@ void Network::evalClassification(DataSet *data, MyReal **state, int output) {
   if (output) printf("Prediction file written: classprediction.dat\n");
 
   delete[] tmpstate;
+  delete[] loss_local;
+  delete[] class_id;
+  delete[] success_local;
 }
 
 void Network::evalClassification_diff(DataSet *data, MyReal **primalstate,
                                       MyReal **adjointstate,
                                       int compute_gradient) {
-  MyReal *tmpstate = new MyReal[nchannels];
+  MyReal *tmpstate = new MyReal[threads->getnThreads() * nchannels];
   ClassificationLayer *classificationlayer;
 
   /* Get classification layer */
@@ -503,20 +660,26 @@ void Network::evalClassification_diff(DataSet *data, MyReal **primalstate,
   int nbatch = data->getnBatch();
   MyReal loss_bar = 1. / nbatch;
 
-  for (int iex = 0; iex < nbatch; iex++) {
-    /* Recompute the Classification */
-    for (int ic = 0; ic < nchannels; ic++) {
-      tmpstate[ic] = primalstate[iex][ic];
+  threads->parallelFor(nbatch, [&](int first, int last) {
+    MyReal *tmp = tmpstate + ThreadPool::getThreadID() * nchannels;
+    for (int iex = first; iex < last; iex++) {
+      /* Recompute the Classification */
+      for (int ic = 0; ic < nchannels; ic++) {
+        tmp[ic] = primalstate[iex][ic];
+      }
+      classificationlayer->setLabel(data->getLabel(iex));
+      classificationlayer->applyFWD(tmp);
+
+      /* Derivative of Loss and classification. */
+      classificationlayer->crossEntropy_diff(tmp, adjointstate[iex],
+                                             loss_bar);
+      classificationlayer->applyBWD(primalstate[iex], adjointstate[iex],
+                                    compute_gradient);
     }
-    classificationlayer->setLabel(data->getLabel(iex));
-    classificationlayer->applyFWD(tmpstate);
+  });
 
-    /* Derivative of Loss and classification. */
-    classificationlayer->crossEntropy_diff(tmpstate, adjointstate[iex],
-                                           loss_bar);
-    classificationlayer->applyBWD(primalstate[iex], adjointstate[iex],
-                                  compute_gradient);
-  }
+  /* Collect the gradient of the threads */
+  if (compute_gradient) classificationlayer->reduceBar();
   // printf("Classification_diff %d using layer %1.14e state %1.14e tmpstate
   // %1.14e biasbar[dimOut-1] %1.14e\n", getIndex(), weights[0],
   // primalstate[1][1], tmpstate[0], bias_bar[dim_Out-1]);
@@ -525,11 +688,18 @@ void Network::evalClassification_diff(DataSet *data, MyReal **primalstate,
 }
 
 void Network::updateDesign(MyReal stepsize, MyReal *direction, MPI_Comm comm) {
+  /* The design must not change while it is being sent */
+  finishGhostExchange();
+
   /* Update design locally on this network-block */
   for (int id = 0; id < ndesign_local; id++) {
     design[id] += stepsize * direction[id];
   }
+  designversion++;
+  publishDesign();
 
-  /* Communicate design across neighbouring processors (ghostlayers) */
-  MPI_CommunicateNeighbours(comm);
+  /* Communicate design across neighbouring processors (ghostlayers). The
+   * exchange overlaps with the next braid run until a ghost layer is
+   * needed. */
+  startGhostExchange();
 }
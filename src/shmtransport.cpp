@@ -0,0 +1,149 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "shmtransport.hpp"
+#include <stdlib.h>
+#include <new>
+
+/* Bytes reserved for the flag at the start of each slot (one cache line) */
+#define SHM_FLAG_BYTES 64
+
+ShmTransport::ShmTransport(MPI_Comm comm, int nSlots, size_t statesize) {
+  int size, nodesize;
+  MPI_Group group, nodegroup;
+
+  nslots = nSlots;
+  slotsize = 0;
+  nodecomm = MPI_COMM_NULL;
+  win = MPI_WIN_NULL;
+  noderank = NULL;
+  segment = NULL;
+
+  if (nslots <= 0) {
+    nslots = 0;
+    return;
+  }
+
+  /* Round the slots up to whole cache lines */
+  slotsize = SHM_FLAG_BYTES + statesize;
+  slotsize = (slotsize + SHM_FLAG_BYTES - 1) / SHM_FLAG_BYTES * SHM_FLAG_BYTES;
+
+  /* Get the ranks on this node */
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                      &nodecomm);
+  MPI_Comm_size(comm, &size);
+  MPI_Comm_size(nodecomm, &nodesize);
+
+  /* Translate ranks of comm into node ranks */
+  int *ranks = new int[size];
+  noderank = new int[size];
+  for (int i = 0; i < size; i++) {
+    ranks[i] = i;
+  }
+  MPI_Comm_group(comm, &group);
+  MPI_Comm_group(nodecomm, &nodegroup);
+  MPI_Group_translate_ranks(group, size, ranks, nodegroup, noderank);
+  for (int i = 0; i < size; i++) {
+    if (noderank[i] == MPI_UNDEFINED) noderank[i] = -1;
+  }
+  MPI_Group_free(&group);
+  MPI_Group_free(&nodegroup);
+  delete[] ranks;
+
+  /* Allocate the slots and get the addresses of all segments on this node */
+  char *mysegment;
+  MPI_Win_allocate_shared(nslots * slotsize, 1, MPI_INFO_NULL, nodecomm,
+                          &mysegment, &win);
+  segment = new char *[nodesize];
+  for (int irank = 0; irank < nodesize; irank++) {
+    MPI_Aint segsize;
+    int dispunit;
+    MPI_Win_shared_query(win, irank, &segsize, &dispunit, &segment[irank]);
+  }
+
+  /* Mark all slots as free */
+  for (int islot = 0; islot < nslots; islot++) {
+    new (mysegment + islot * slotsize) std::atomic<int>(0);
+  }
+
+  /* Open a passive epoch on the window for the lifetime of the transport */
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+  MPI_Win_sync(win);
+  MPI_Barrier(nodecomm);
+}
+
+ShmTransport::~ShmTransport() {
+  if (win != MPI_WIN_NULL) {
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+  }
+  if (nodecomm != MPI_COMM_NULL) MPI_Comm_free(&nodecomm);
+  delete[] noderank;
+  delete[] segment;
+}
+
+std::atomic<int> *ShmTransport::getFlag(int nrank, int slot) {
+  return (std::atomic<int> *)(segment[nrank] + slot * slotsize);
+}
+
+int ShmTransport::onNode(int first, int last) {
+  if (nslots == 0) return 0;
+
+  for (int irank = first; irank <= last; irank++) {
+    if (noderank[irank] < 0) return 0;
+  }
+  return 1;
+}
+
+int ShmTransport::acquireSlot() {
+  int myrank;
+  MPI_Comm_rank(nodecomm, &myrank);
+
+  for (int islot = 0; islot < nslots; islot++) {
+    std::atomic<int> *flag = getFlag(myrank, islot);
+    if (flag->load(std::memory_order_acquire) == 0) {
+      flag->store(1, std::memory_order_relaxed);
+      return islot;
+    }
+  }
+
+  return -1;
+}
+
+MyReal *ShmTransport::getSlotData(int owner, int slot) {
+  int nrank = noderank[owner];
+
+  if (nrank < 0) {
+    printf("\n\n ERROR: Shared memory slot of rank %d is not on this node!\n\n",
+           owner);
+    exit(1);
+  }
+
+  return (MyReal *)(segment[nrank] + slot * slotsize + SHM_FLAG_BYTES);
+}
+
+void ShmTransport::publishSlot() { MPI_Win_sync(win); }
+
+void ShmTransport::syncSlots() { MPI_Win_sync(win); }
+
+void ShmTransport::releaseSlot(int owner, int slot) {
+  getFlag(noderank[owner], slot)->store(0, std::memory_order_release);
+}
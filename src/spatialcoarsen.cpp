@@ -0,0 +1,128 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "spatialcoarsen.hpp"
+#include <math.h>
+#include <algorithm>
+
+SpatialCoarsening::SpatialCoarsening(int nChannels, int nFeatures,
+                                     int nHalvings) {
+  nconv = nChannels / nFeatures;
+
+  /* Halve the images until they are 3x3 */
+  sides = new int[nHalvings + 1];
+  sides[0] = round(sqrt(nFeatures));
+  nres = 1;
+  while (nres <= nHalvings && sides[nres - 1] > 3) {
+    sides[nres] = (sides[nres - 1] + 1) / 2;
+    nres++;
+  }
+}
+
+SpatialCoarsening::~SpatialCoarsening() { delete[] sides; }
+
+int SpatialCoarsening::getnConv() { return nconv; }
+
+int SpatialCoarsening::getnResolutions() { return nres; }
+
+int SpatialCoarsening::getSide(int res) { return sides[res]; }
+
+int SpatialCoarsening::getnChannels(int res) {
+  return nconv * sides[res] * sides[res];
+}
+
+int SpatialCoarsening::getResolution(int nChannels) {
+  for (int res = 0; res < nres; res++) {
+    if (getnChannels(res) == nChannels) return res;
+  }
+  return -1;
+}
+
+void SpatialCoarsening::restrictImage(int res, MyReal *fine,
+                                      MyReal *coarse) {
+  int m = sides[res];
+  int mc = sides[res + 1];
+
+  for (int J = 0; J < mc; J++) {
+    for (int K = 0; K < mc; K++) {
+      /* Mean of the pixels of the block (fewer at the odd edges) */
+      MyReal sum = 0.0;
+      int count = 0;
+      for (int j = 2 * J; j < std::min(2 * J + 2, m); j++) {
+        for (int k = 2 * K; k < std::min(2 * K + 2, m); k++) {
+          sum += fine[j * m + k];
+          count++;
+        }
+      }
+      coarse[J * mc + K] = sum / count;
+    }
+  }
+}
+
+void SpatialCoarsening::restrict(int res, MyReal *fine, MyReal *coarse) {
+  int m = sides[res];
+  int mc = sides[res + 1];
+
+  for (int i = 0; i < nconv; i++) {
+    restrictImage(res, &(fine[i * m * m]), &(coarse[i * mc * mc]));
+  }
+}
+
+void SpatialCoarsening::interpolate(int res, MyReal *coarse, MyReal *fine) {
+  int m = sides[res];
+  int mc = sides[res + 1];
+
+  for (int i = 0; i < nconv; i++) {
+    MyReal *fimg = &(fine[i * m * m]);
+    MyReal *cimg = &(coarse[i * mc * mc]);
+    for (int j = 0; j < m; j++) {
+      for (int k = 0; k < m; k++) {
+        fimg[j * m + k] = cimg[(j / 2) * mc + k / 2];
+      }
+    }
+  }
+}
+
+void SpatialCoarsening::coarsenDesign(int res, MyReal *fine, MyReal *coarse) {
+  int nkernels = nconv * nconv;
+
+  /* Galerkin kernels: the fine pixel (2J+s, 2K+t) of a block sees the
+   * neighbour (a, b) in the block (floor((s+a)/2), floor((t+b)/2)) */
+  for (int kernel = 0; kernel < nkernels; kernel++) {
+    MyReal *fk = &(fine[kernel * 9]);
+    MyReal *ck = &(coarse[kernel * 9]);
+    for (int i = 0; i < 9; i++) ck[i] = 0.0;
+    for (int s = 0; s < 2; s++) {
+      for (int t = 0; t < 2; t++) {
+        for (int a = -1; a <= 1; a++) {
+          for (int b = -1; b <= 1; b++) {
+            int A = (int)floor((s + a) / 2.0);
+            int B = (int)floor((t + b) / 2.0);
+            ck[(A + 1) * 3 + B + 1] += 0.25 * fk[(a + 1) * 3 + b + 1];
+          }
+        }
+      }
+    }
+  }
+
+  /* The bias is one image */
+  restrictImage(res, &(fine[nkernels * 9]), &(coarse[nkernels * 9]));
+}
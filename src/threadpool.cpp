@@ -0,0 +1,291 @@
+// Copyright
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Underlying paper:
+//
+// Layer-Parallel Training of Deep Residual Neural Networks
+// S. Guenther, L. Ruthotto, J.B. Schroder, E.C. Czr, and N.R. Gauger
+//
+// Download: https://arxiv.org/pdf/1812.04352.pdf
+//
+#include "threadpool.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "config.hpp"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+/* Size of a transparent huge page */
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+
+thread_local int ThreadPool::threadid = 0;
+
+ThreadPool::ThreadPool(int nThreads, int Pinning, int HugePages) {
+  nthreads = nThreads > 1 ? nThreads : 1;
+  generation = 0;
+  nbusy = 0;
+  stop = 0;
+  length = 0;
+  body = NULL;
+  progressinterval = 0;
+  hugepages = HugePages;
+  cpus.assign(nthreads, -1);
+
+  for (int tid = 1; tid < nthreads; tid++) {
+    workers.push_back(std::thread(&ThreadPool::work, this, tid));
+  }
+  bind(Pinning);
+}
+
+void ThreadPool::bind(int pinning) {
+#ifdef __linux__
+  if (pinning == PIN_NONE) return;
+
+  /* Cores this processor may run on, e.g. as set by mpirun */
+  cpu_set_t allowed;
+  std::vector<int> cores;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) cores.push_back(cpu);
+  }
+  int ncores = cores.size();
+  if (ncores == 0) return;
+
+  for (int tid = 0; tid < nthreads; tid++) {
+    /* Compact: neighbouring cores. Scatter: evenly spaced cores. */
+    int icore = tid % ncores;
+    if (pinning == PIN_SCATTER) {
+      icore = (int)(((long)tid * ncores) / nthreads) % ncores;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cores[icore], &set);
+    pthread_t thread =
+        tid == 0 ? pthread_self() : workers[tid - 1].native_handle();
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) == 0) {
+      cpus[tid] = cores[icore];
+    }
+  }
+#endif
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = 1;
+  }
+  wake.notify_all();
+  for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+int ThreadPool::getnThreads() { return nthreads; }
+
+int ThreadPool::getThreadID() { return threadid; }
+
+int ThreadPool::getCPU(int tid) { return cpus[tid]; }
+
+void ThreadPool::writeBinding(FILE *outfile, MPI_Comm comm) {
+  int rank, size, namelength;
+  char name[MPI_MAX_PROCESSOR_NAME];
+  int *allcpus = NULL;
+  char *allnames = NULL;
+
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+  memset(name, 0, MPI_MAX_PROCESSOR_NAME);
+  MPI_Get_processor_name(name, &namelength);
+
+  /* Gather the cores and host names (same number of threads everywhere) */
+  if (rank == 0) {
+    allcpus = new int[size * nthreads];
+    allnames = new char[size * MPI_MAX_PROCESSOR_NAME];
+  }
+  MPI_Gather(cpus.data(), nthreads, MPI_INT, allcpus, nthreads, MPI_INT, 0,
+             comm);
+  MPI_Gather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, allnames,
+             MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, comm);
+
+  if (rank == 0) {
+    fprintf(outfile, "# Thread binding (thread->core):\n");
+    for (int irank = 0; irank < size; irank++) {
+      fprintf(outfile, "#                rank %d on %s:", irank,
+              &(allnames[irank * MPI_MAX_PROCESSOR_NAME]));
+      for (int tid = 0; tid < nthreads; tid++) {
+        int cpu = allcpus[irank * nthreads + tid];
+        if (cpu < 0) {
+          fprintf(outfile, " %d->any", tid);
+        } else {
+          fprintf(outfile, " %d->%d", tid, cpu);
+        }
+      }
+      fprintf(outfile, "\n");
+    }
+    delete[] allcpus;
+    delete[] allnames;
+  }
+}
+
+MyReal *ThreadPool::allocate(int nrows, int rowsize) {
+  size_t size = (size_t)nrows * rowsize * sizeof(MyReal);
+  size_t alignment = 64;
+  void *data = NULL;
+
+  /* Arrays of at least one huge page are aligned to and padded to huge
+   * pages, smaller ones to cache lines */
+  if (hugepages && size >= HUGEPAGESIZE) {
+    alignment = HUGEPAGESIZE;
+    size = (size + HUGEPAGESIZE - 1) / HUGEPAGESIZE * HUGEPAGESIZE;
+  }
+  if (posix_memalign(&data, alignment, std::max(size, alignment)) != 0) {
+    printf("\n\n ERROR: Can't allocate %zu bytes!\n\n", size);
+    exit(1);
+  }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (alignment == HUGEPAGESIZE) madvise(data, size, MADV_HUGEPAGE);
+#endif
+
+  /* Zero the rows on the threads that compute on them */
+  MyReal *values = (MyReal *)data;
+  parallelFor(nrows, [&](int first, int last) {
+    memset(&(values[(size_t)first * rowsize]), 0,
+           (size_t)(last - first) * rowsize * sizeof(MyReal));
+  });
+
+  return values;
+}
+
+void ThreadPool::deallocate(MyReal *data) { free(data); }
+
+void ThreadPool::setProgress(int interval, const std::function<void()> &hook) {
+  progressinterval = interval;
+  progress = hook;
+}
+
+void ThreadPool::getChunk(int tid, int n, int *first, int *last) {
+  *first = (int)(((long)n * tid) / nthreads);
+  *last = (int)(((long)n * (tid + 1)) / nthreads);
+}
+
+void ThreadPool::runChunk(int first, int last,
+                          const std::function<void(int, int)> &f) {
+  if (progressinterval <= 0) {
+    if (first < last) f(first, last);
+    return;
+  }
+
+  for (int i = first; i < last; i += progressinterval) {
+    f(i, std::min(i + progressinterval, last));
+    progress();
+  }
+}
+
+void ThreadPool::work(int tid) {
+  int seen = 0;
+  int first, last;
+
+  threadid = tid;
+  while (1) {
+    /* Wait for the next loop */
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [&] { return stop || generation != seen; });
+    if (stop) return;
+    seen = generation;
+    getChunk(tid, length, &first, &last);
+    lock.unlock();
+
+    if (first < last) (*body)(first, last);
+
+    /* Report the chunk as done */
+    lock.lock();
+    nbusy--;
+    if (nbusy == 0) done.notify_one();
+  }
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int, int)> &f) {
+  int first, last;
+
+  /* Serial execution, without waking the workers */
+  if (nthreads == 1 || n < 2) {
+    runChunk(0, n, f);
+    return;
+  }
+
+  /* Issue the loop to the workers */
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    length = n;
+    body = &f;
+    nbusy = nthreads - 1;
+    generation++;
+  }
+  wake.notify_all();
+
+  /* Process chunk 0 */
+  getChunk(0, n, &first, &last);
+  runChunk(first, last, f);
+
+  /* Wait for the workers */
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return nbusy == 0; });
+  body = NULL;
+}
+
+void ThreadPool::runTasks(int ntasks, const std::function<void(int)> &task) {
+  int first, last;
+
+  /* Queue of each thread, initially holding its chunk of the tasks */
+  std::vector<std::deque<int> > queues(nthreads);
+  std::vector<std::mutex> locks(nthreads);
+  for (int tid = 0; tid < nthreads; tid++) {
+    getChunk(tid, ntasks, &first, &last);
+    for (int i = first; i < last; i++) queues[tid].push_back(i);
+  }
+
+  /* One chunk of the loop per thread */
+  parallelFor(nthreads, [&](int, int) {
+    int tid = getThreadID();
+    while (1) {
+      int next = -1;
+
+      /* Take the next task of the own queue */
+      {
+        std::lock_guard<std::mutex> lock(locks[tid]);
+        if (!queues[tid].empty()) {
+          next = queues[tid].front();
+          queues[tid].pop_front();
+        }
+      }
+
+      /* Else steal the last task of another queue */
+      for (int i = 1; next < 0 && i < nthreads; i++) {
+        int victim = (tid + i) % nthreads;
+        std::lock_guard<std::mutex> lock(locks[victim]);
+        if (!queues[victim].empty()) {
+          next = queues[victim].back();
+          queues[victim].pop_back();
+        }
+      }
+
+      if (next < 0) return;
+      task(next);
+    }
+  });
+}
@@ -23,56 +23,95 @@ nptlist  = args.nprocs
 braid_maxlevelslist = args.maxlevels
 print("Testing case \"" + case +  "\", npt=" + str(nptlist) + ", braid_maxlevels=" + str(braid_maxlevelslist))
 
+# Variants of the peaks case: name, config changes, number of processors
+# and braid_maxlevels. They run after the plain case.
+variants = []
+if case == "peaks":
+    variants = [
+        ("oneshot", {"optim_oneshot": 2, "stepsize": 8.0}, [2], [1]),
+        ("replicas", {"nreplicas": 2}, [4], [1]),
+        ("gradcompress", {"nreplicas": 2, "gradient_compress": "bf16"}, [4],
+         [1]),
+        ("tensor", {"ntensor": 2}, [4], [1]),
+        ("compress", {"braid_compress": "bf16"}, [2], [1]),
+        ("checkpoint", {"braid_checkpoint": 4, "braid_primalstore": "fp32"},
+         [2], [1]),
+        ("serial", {"braid_serial": "on"}, [2], [1]),
+    ]
+
 # Specify the output file to compare
 outfile = "optim.dat"
 
 # Get the global config file
 config = Config(case + ".cfg")
 
+def runtest(testname, konfig, npt):
+    """ runtest(testname, konfig, npt)
+        runs main with the config on npt processors in the folder
+        test.<testname> and compares the output file to the reference
+        <testname>.optim.dat
+    """
+
+    # Create testing folder
+    testfoldername = "test." + testname
+    if os.path.exists(testfoldername):
+       pass
+    else:
+       os.mkdir(testfoldername)
+
+    # create a link to training and validation data
+    datafolder = config.datafolder
+    make_link(datafolder, testfoldername + "/data" )
+
+    # Set the data folder
+    konfig = copy.deepcopy(konfig)
+    konfig.datafolder = "data"
+
+    # create the config file
+    testconfig = testname + ".cfg"
+    konfig.dump(testfoldername + "/" + testconfig)
+
+    # run the test
+    os.chdir(testfoldername)
+    runcommand = "mpirun -n " + str(npt) + " ../../main " + testconfig + " > tmp"
+    print("Running Test: " + testname)
+    #print("  " + runcommand)
+    subprocess.call(runcommand, shell=True)
+    os.chdir("../")
+
+    # compare output file to the reference
+    refname = testname  + "." + outfile
+    err = comparefiles(refname, testfoldername + "/" + outfile)
+
+    # Print result
+    if (err > 0):
+        print("  !!! Test failed !!!")
+        print("  vimdiff " + refname + " " + testfoldername + "/" + outfile)
+    else:
+        print("  Test passed!")
+
 # Iterate over configuration
 for j,ml in enumerate(braid_maxlevelslist):
 
     # Iterate over number of processors
     for i,npt in enumerate(nptlist):
 
-        # Set the test case name 
-        testname = case + ".npt" + str(npt) + ".ml" + str(ml) 
-    
-        # Create testing folder
-        testfoldername = "test." + testname
-        if os.path.exists(testfoldername):
-           pass
-        else:
-           os.mkdir(testfoldername)
-       
-        # create a link to training and validation data
-        datafolder = config.datafolder
-        make_link(datafolder, testfoldername + "/data" )
-        
         # Set the new configuration
         konfig = copy.deepcopy(config)
-        konfig.braid_maxlevels = ml 
-        konfig.datafolder = "data"
-    
-        # create the config file
-        testconfig = testname + ".cfg"
-        konfig.dump(testfoldername + "/" + testconfig)
-        
-        # run the test
-        os.chdir(testfoldername)
-        runcommand = "mpirun -n " + str(npt) + " ../../main " + testconfig + " > tmp"
-        print("Running Test: " + testname)
-        #print("  " + runcommand)
-        subprocess.call(runcommand, shell=True)
-        os.chdir("../")
-        
-        # compare output file to the reference
-        refname = testname  + "." + outfile 
-        err = comparefiles(refname, testfoldername + "/" + outfile)
-        
-        # Print result
-        if (err > 0):
-            print("  !!! Test failed !!!")
-            print("  vimdiff " + refname + " " + testfoldername + "/" + outfile)
-        else:
-            print("  Test passed!")
+        konfig.braid_maxlevels = ml
+
+        runtest(case + ".npt" + str(npt) + ".ml" + str(ml), konfig, npt)
+
+# Iterate over the variants
+for name, changes, variantnptlist, variantmllist in variants:
+    for ml in variantmllist:
+        for npt in variantnptlist:
+
+            # Set the new configuration
+            konfig = copy.deepcopy(config)
+            konfig.braid_maxlevels = ml
+            for key in changes:
+                konfig[key] = changes[key]
+
+            runtest(case + "." + name + ".npt" + str(npt) + ".ml" + str(ml),
+                    konfig, npt)